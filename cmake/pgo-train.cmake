@@ -0,0 +1,35 @@
+# Runs an instrumented git-recent over the usual invocations to collect the
+# profile for a GIT_RECENT_PGO=USE build.
+#
+# Expects GIT_RECENT, REPO and PGO_DIR, and LLVM_PROFDATA for Clang builds.
+
+set(runs
+    "-n 0"
+    "--remote -n 0"
+    "--all -n 0"
+    "--sort=name,time -n 0"
+    "--stale 30"
+    "--prompt")
+
+foreach(run IN LISTS runs)
+  separate_arguments(args UNIX_COMMAND "${run}")
+  message(STATUS "git-recent ${run}")
+  execute_process(COMMAND ${GIT_RECENT} ${args}
+                  WORKING_DIRECTORY ${REPO}
+                  OUTPUT_QUIET
+                  RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "git-recent ${run} failed")
+  endif()
+endforeach()
+
+# Clang writes raw profiles that need merging, GCC uses the .gcda directly.
+file(GLOB raw_profiles ${PGO_DIR}/*.profraw)
+if(raw_profiles)
+  if(NOT LLVM_PROFDATA)
+    message(FATAL_ERROR "llvm-profdata is needed to merge the Clang profiles")
+  endif()
+  execute_process(COMMAND ${LLVM_PROFDATA} merge
+                          -output=${PGO_DIR}/default.profdata ${raw_profiles}
+                  COMMAND_ERROR_IS_FATAL ANY)
+endif()
@@ -0,0 +1,68 @@
+// Copyright (c) 2022 Caio Oliveira
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "commit.h"
+
+#include <optional>
+
+std::string_view raw_commit_message(std::string_view raw) {
+  const auto end = raw.find("\n\n");
+  return end == raw.npos ? std::string_view() : raw.substr(end + 2);
+}
+
+void append_summary(std::string &out, std::string_view message) {
+  auto is_space = [](char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+           c == '\f';
+  };
+
+  message = message.substr(0, message.find('\0'));
+  size_t i = message.find_first_not_of('\n');
+  if (i == message.npos)
+    return;
+  std::optional<size_t> space;
+  for (; i < message.size(); i++) {
+    const char c = message[i];
+    if (c == '\n') {
+      // A line with only whitespace ends the paragraph too.
+      size_t next = i + 1;
+      while (next < message.size() && message[next] != '\n' &&
+             is_space(message[next]))
+        next++;
+      if (next == message.size() || message[next] == '\n')
+        break;
+    }
+    if (is_space(c)) {
+      if (!space)
+        space = i;
+      continue;
+    }
+    if (space) {
+      const auto run = message.substr(*space, i - *space);
+      if (run.find('\n') != run.npos)
+        out += ' ';
+      else
+        out += run;
+      space.reset();
+    }
+    out += c;
+  }
+}
@@ -0,0 +1,38 @@
+// Copyright (c) 2022 Caio Oliveira
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Readers for raw commit objects as stored in the object database, for the
+// paths that don't need libgit2 to parse a whole commit.
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Message of a raw commit object: what follows the first empty line, the
+// header lines can't be empty (continuation lines start with a space).
+std::string_view raw_commit_message(std::string_view raw);
+
+// Appends the first paragraph of a commit message like git_commit_summary
+// does: leading newlines are skipped, whitespace runs that span lines become
+// a single space and trailing whitespace is dropped.  Works on a truncated
+// message, stopping where it ends, and like libgit2 stops at a NUL byte.
+void append_summary(std::string &out, std::string_view message);
@@ -0,0 +1,159 @@
+// Copyright (c) 2022 Caio Oliveira
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// libFuzzer target for the parsers that read git's on-disk formats without
+// libgit2.  The first byte of the input picks the parser, the rest is the
+// data: a raw commit object, a pack index, or the bitmap of a small pack
+// whose index is generated so that the bitmap's checksum matches it.
+
+#include "commit.h"
+#include "pack.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+std::filesystem::path scratch(const char *extension) {
+  return std::filesystem::temp_directory_path() /
+         ("git-recent-fuzz-" + std::to_string(getpid()) + extension);
+}
+
+void write_file(const std::filesystem::path &path,
+                std::span<const unsigned char> data) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(data.data()),
+            std::streamsize(data.size()));
+}
+
+void put32(std::vector<unsigned char> &out, uint32_t v) {
+  for (int shift = 24; shift >= 0; shift -= 8)
+    out.push_back(uint8_t(v >> shift));
+}
+
+git_oid nth_id(uint32_t n) {
+  git_oid id{};
+  id.id[0] = uint8_t(n);
+  return id;
+}
+
+void fuzz_summary(std::span<const unsigned char> data) {
+  const std::string_view raw(reinterpret_cast<const char *>(data.data()),
+                             data.size());
+  std::string summary;
+  append_summary(summary, raw_commit_message(raw));
+  if (summary.find('\n') != summary.npos)
+    __builtin_trap();
+}
+
+void exercise(const pack_index &index, const std::filesystem::path &path) {
+  for (uint32_t pos = 0; pos < index.size() && pos < 4096; pos++) {
+    const git_oid id = index.id(pos);
+    index.offset(pos);
+    // Ids out of order can make the search miss, but never return a
+    // position holding another id.
+    if (auto found = index.find(id)) {
+      const git_oid other = index.id(*found);
+      if (memcmp(other.id, id.id, sizeof(id.id)) != 0)
+        __builtin_trap();
+    }
+  }
+  if (index.size() <= 4096)
+    pack_order(index, path);
+}
+
+void fuzz_index(std::span<const unsigned char> data) {
+  const auto path = scratch(".idx");
+  write_file(path, data);
+  if (auto index = pack_index::open(path))
+    exercise(*index, path);
+  std::filesystem::remove(path);
+}
+
+// An index of up to 256 objects, the Nth with an id starting with byte N,
+// followed by a bitmap from the input with the pack checksum patched in.
+void fuzz_bitmap(std::span<const unsigned char> data) {
+  if (data.empty())
+    return;
+  const uint32_t count = uint32_t(data[0]) + 1;
+  data = data.subspan(1);
+
+  std::vector<unsigned char> idx = {0xff, 't', 'O', 'c', 0, 0, 0, 2};
+  for (uint32_t i = 0; i < 256; i++)
+    put32(idx, std::min(i + 1, count));
+  for (uint32_t i = 0; i < count; i++) {
+    const git_oid id = nth_id(i);
+    idx.insert(idx.end(), id.id, id.id + sizeof(id.id));
+  }
+  idx.resize(idx.size() + size_t(count) * 4);
+  for (uint32_t i = 0; i < count; i++)
+    put32(idx, 12 + (count - i) * 32);
+  idx.resize(idx.size() + 40);
+
+  std::vector<unsigned char> bitmap(data.begin(), data.end());
+  if (bitmap.size() >= 32)
+    std::fill(bitmap.begin() + 12, bitmap.begin() + 32, 0);
+
+  const auto idx_path = scratch(".idx");
+  const auto bitmap_path = scratch(".bitmap");
+  write_file(idx_path, idx);
+  write_file(bitmap_path, bitmap);
+
+  if (auto bitmaps = pack_bitmap::open(idx_path)) {
+    for (uint32_t i = 0; i < count; i++) {
+      const git_oid from = nth_id(i);
+      bitmaps->count_commits(from);
+      bitmaps->is_reachable(nth_id(count - 1 - i), from);
+    }
+  }
+
+  std::filesystem::remove(idx_path);
+  std::filesystem::remove(bitmap_path);
+}
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size == 0)
+    return 0;
+  const std::span<const unsigned char> input(data + 1, size - 1);
+  switch (data[0] % 3) {
+  case 0:
+    fuzz_summary(input);
+    break;
+  case 1:
+    fuzz_index(input);
+    break;
+  case 2:
+    fuzz_bitmap(input);
+    break;
+  }
+  return 0;
+}
@@ -18,27 +18,67 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include "commit.h"
+#include "pack.h"
+
 #include <boost/outcome.hpp>
+#ifndef GIT_RECENT_MINIMAL_OPTIONS
 #include <boost/program_options.hpp>
+#endif
 #include <git2.h>
+#include <git2/sys/alloc.h>
+#include <git2/sys/odb_backend.h>
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <charconv>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <optional>
 #include <span>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 // TODO: Should (also) look at "ref" file date?
-// TODO: Colored output?
 
 namespace {
 
 struct entry {
   entry(git_reference *ref, git_commit *commit)
-      : ref(ref), commit(commit), name(nullptr) {
+      : ref(ref), commit(commit), commit_id(*git_commit_id(commit)),
+        name(nullptr) {
     git_branch_name(&name, ref);
     commit_time = std::chrono::system_clock::time_point{
         std::chrono::seconds(git_commit_time(commit))};
@@ -46,11 +86,46 @@ struct entry {
 
   git_reference *ref;
   git_commit *commit;
+  git_oid commit_id;
 
   const char *name;
   std::chrono::system_clock::time_point commit_time;
+
+  // Checked out in the current worktree.
+  bool head = false;
+
+  // Checked out in some worktree, not necessarily the current one.
+  bool worktree_head = false;
+
+  // With --all, the remote-tracking branch shown in the same row.
+  const entry *upstream = nullptr;
+
+  // With --stale, whether the branch is merged into the base.
+  std::optional<bool> merged;
+
+  // Summary of the row's most recent commit, from whichever side of the
+  // pair that is, set by load_summaries before printing.
+  std::string_view summary;
+
+  std::chrono::system_clock::time_point last_activity() const {
+    return upstream ? std::max(commit_time, upstream->commit_time)
+                    : commit_time;
+  }
+
+  // Under --max-memory the commit is dropped once selected, to be looked up
+  // again by its id when it is needed.
+  void release_commit() {
+    git_commit_free(commit);
+    commit = nullptr;
+  }
 };
 
+// TODO: Is there a better way to do this?
+template <typename T>
+std::unique_ptr<T, void (*)(T *)> make_unique_with_deleter(auto *t, auto *d) {
+  return std::unique_ptr<T, void (*)(T *)>(t, d);
+}
+
 struct error {
   std::string msg;
 };
@@ -62,44 +137,233 @@ error make_git_error() {
     return {"error"};
 }
 
-std::string format_duration(std::chrono::system_clock::duration duration) {
-  namespace c = std::chrono;
+// Units ages are shown in, largest first.  Years are 365 days.
+struct duration_unit {
+  std::chrono::seconds length;
+  char suffix;
+};
 
-  const auto d = c::duration_cast<c::days>(duration);
-  const auto h = c::duration_cast<c::hours>(duration - d);
-  const auto m = c::duration_cast<c::minutes>(duration - d - h);
-
-  std::ostringstream oss;
-  if (d.count() > 0)
-    oss << std::setw(5) << d.count() << "d ago";
-  else if (h.count() > 0)
-    oss << std::setw(5) << h.count() << "h ago";
-  else if (d.count() > 0)
-    oss << std::setw(5) << m.count() << "m ago";
-  else
-    oss << std::setw(10) << "now";
+constexpr duration_unit duration_units[] = {
+    {std::chrono::days(365), 'y'},  {std::chrono::weeks(1), 'w'},
+    {std::chrono::days(1), 'd'},    {std::chrono::hours(1), 'h'},
+    {std::chrono::minutes(1), 'm'}, {std::chrono::seconds(1), 's'},
+};
+
+// Ages are right aligned to a fixed width, like "   12d ago".
+constexpr size_t duration_width = 10;
+using duration_buffer = std::array<char, duration_width>;
+
+// Formats an age in its largest whole unit into the caller's buffer, or as
+// "now" when under a second (or in the future).
+std::string_view format_duration(std::chrono::system_clock::duration duration,
+                                 duration_buffer &buf) {
+  const auto seconds =
+      std::chrono::duration_cast<std::chrono::seconds>(duration);
+  buf.fill(' ');
+  const std::string_view out(buf.data(), buf.size());
+
+  for (const auto &unit : duration_units) {
+    if (seconds < unit.length)
+      continue;
+    // Five digits, enough for days until the 27th century.
+    auto count = std::min<int64_t>(seconds / unit.length, 99999);
+    char *digit = buf.data() + 5;
+    do {
+      *--digit = char('0' + count % 10);
+      count /= 10;
+    } while (count > 0);
+    buf[5] = unit.suffix;
+    memcpy(buf.data() + 6, " ago", 4);
+    return out;
+  }
 
-  return oss.str();
+  memcpy(buf.data() + duration_width - 3, "now", 3);
+  return out;
 }
 
 struct options {
   unsigned n;
   bool remote;
+  bool all;
+  bool progressive;
+  bool pick;
+  std::optional<unsigned> stale_days;
+  std::string base;
+  bool mine;
+  std::optional<std::string> since;
+  std::optional<std::string> until;
+  std::string sort;
+  bool prompt;
+  bool prefetch;
+  bool profile;
+  std::optional<size_t> max_memory;
+  std::optional<size_t> cache_size;
+  std::string color;
+  bool absolute;
 };
 
-options parse_options(int argc, char *argv[]) {
+// Command line options, shared by the Boost.Program_options parser and the
+// minimal one used for static builds.  Names follow Boost's "long,short"
+// syntax and options with a value name take an argument.
+struct option_spec {
+  const char *name;
+  const char *value_name;
+  const char *help;
+};
+
+// clang-format off
+constexpr option_spec option_specs[] = {
+  {"help,h", nullptr, "produce help message"},
+  {"count,n", "N",
+   "show at most N branches (7 by default), zero means all branches"},
+  {"remote", nullptr,
+   "show remote branches instead of local branches"},
+  {"all", nullptr,
+   "show both local and remote branches, with a local branch and its "
+   "upstream sharing a row"},
+  {"progressive", nullptr,
+   "print the most recent branches while still enumerating, updating them "
+   "in place (only when output is a terminal and N isn't zero)"},
+  {"pick", nullptr,
+   "interactively pick a branch with fuzzy search and check it out"},
+  {"stale", "N",
+   "show only branches not updated in the last N days, and whether they are "
+   "merged into the base; shows all of them unless -n is given"},
+  {"base", "REV",
+   "branch or commit that --stale checks merges against (HEAD by default)"},
+  {"mine", nullptr,
+   "order by the most recent commit authored by user.email in each branch, "
+   "skipping branches without one"},
+  {"since", "TIME",
+   "show only branches updated after this time, either an age like 2w "
+   "(units s, m, h, d, w, mo, y) or a YYYY-MM-DD date in UTC"},
+  {"until", "TIME",
+   "show only branches updated before this time, like --since"},
+  {"sort", "KEYS",
+   "comma separated sort keys: time (most recent first, the default), name, "
+   "author (of the tip) and ahead (commits ahead of upstream, most first); "
+   "name always breaks the remaining ties"},
+  {"prompt", nullptr,
+   "print just the names of the most recent local branches (3 unless -n is "
+   "given) on one line, for shell prompts; served from a cache in the git "
+   "directory while refs are unchanged"},
+  {"prefetch", nullptr,
+   "ask the kernel to read ahead the branch commits in large batches, for "
+   "repositories on network filesystems"},
+  {"profile", nullptr,
+   "print the time taken and the memory used by libgit2 to stderr"},
+  {"max-memory", "SIZE",
+   "keep libgit2's memory use near SIZE bytes (K, M and G suffixes), "
+   "trading it for looking up commits again when printing"},
+  {"cache-size", "SIZE",
+   "size of libgit2's object cache (K, M and G suffixes), zero disables it; "
+   "by default it grows with the number of branches"},
+  {"color", "WHEN",
+   "color the output: auto (the default, only on a terminal and unless "
+   "NO_COLOR is set), always or never"},
+  {"absolute", nullptr,
+   "show commit times as ISO 8601 local times instead of ages"},
+};
+// clang-format on
+
+// Long option name to its value, empty for flags.
+using option_values = std::unordered_map<std::string, std::string>;
+
+std::string_view long_name(const option_spec &spec) {
+  std::string_view name = spec.name;
+  return name.substr(0, name.find(','));
+}
+
+#ifdef GIT_RECENT_MINIMAL_OPTIONS
+
+// Hand-rolled parser, avoiding the cost of loading and initializing
+// Boost.Program_options at startup.  Accepts --name, --name=value,
+// --name value, -x value and -xvalue.
+option_values parse_command_line(int argc, char *argv[]) {
+  auto fail = [](const std::string &msg) {
+    std::cerr << "error: " << msg << "\n";
+    exit(EXIT_FAILURE);
+  };
+
+  option_values values;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    const option_spec *spec = nullptr;
+    std::optional<std::string_view> inline_value;
+
+    if (arg.starts_with("--")) {
+      arg.remove_prefix(2);
+      if (auto eq = arg.find('='); eq != arg.npos) {
+        inline_value = arg.substr(eq + 1);
+        arg = arg.substr(0, eq);
+      }
+      for (const auto &s : option_specs)
+        if (long_name(s) == arg)
+          spec = &s;
+    } else if (arg.size() >= 2 && arg[0] == '-') {
+      for (const auto &s : option_specs) {
+        std::string_view name = s.name;
+        const auto comma = name.find(',');
+        if (comma != name.npos && name.substr(comma + 1) == arg.substr(1, 1))
+          spec = &s;
+      }
+      if (arg.size() > 2)
+        inline_value = arg.substr(2);
+    }
+    if (!spec)
+      fail("unrecognised option '" + std::string(argv[i]) + "'");
+
+    std::string value;
+    if (spec->value_name) {
+      if (inline_value)
+        value = *inline_value;
+      else if (i + 1 < argc)
+        value = argv[++i];
+      else
+        fail("option '--" + std::string(long_name(*spec)) +
+             "' requires an argument");
+    } else if (inline_value) {
+      fail("option '--" + std::string(long_name(*spec)) +
+           "' does not take any arguments");
+    }
+    values[std::string(long_name(*spec))] = value;
+  }
+
+  if (values.contains("help")) {
+    std::cout << "Allowed options:\n";
+    for (const auto &s : option_specs) {
+      std::string_view name = s.name;
+      const auto comma = name.find(',');
+      std::string usage = "  ";
+      if (comma != name.npos)
+        usage += "-" + std::string(name.substr(comma + 1)) + " [ --" +
+                 std::string(name.substr(0, comma)) + " ]";
+      else
+        usage += "--" + std::string(name);
+      if (s.value_name)
+        usage += std::string(" ") + s.value_name;
+      std::cout << std::left << std::setw(24) << usage << " " << s.help
+                << "\n";
+    }
+    exit(0);
+  }
+
+  return values;
+}
+
+#else
+
+option_values parse_command_line(int argc, char *argv[]) {
   namespace po = boost::program_options;
 
   po::options_description desc("Allowed options");
-
-  // clang-format off
-  desc.add_options()
-    ("help,h", "produce help message")
-    ("count,n", po::value<unsigned>()->default_value(7u),
-     "show at most N branches, zero means all branches")
-    ("remote",
-     "show remote branches instead of local branches");
-  // clang-format on
+  for (const auto &s : option_specs) {
+    if (s.value_name)
+      desc.add_options()(
+          s.name, po::value<std::string>()->value_name(s.value_name), s.help);
+    else
+      desc.add_options()(s.name, s.help);
+  }
 
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -110,108 +374,2810 @@ options parse_options(int argc, char *argv[]) {
     exit(0);
   }
 
+  option_values values;
+  for (const auto &s : option_specs) {
+    const std::string name(long_name(s));
+    if (vm.count(name))
+      values[name] = s.value_name ? vm[name].as<std::string>() : "";
+  }
+  return values;
+}
+
+#endif
+
+options parse_options(int argc, char *argv[]) {
+  const auto values = parse_command_line(argc, argv);
+
+  auto optional_string = [&](const char *name) -> std::optional<std::string> {
+    auto it = values.find(name);
+    if (it == values.end())
+      return {};
+    return it->second;
+  };
+
+  auto optional_unsigned = [&](const char *name) -> std::optional<unsigned> {
+    auto s = optional_string(name);
+    if (!s)
+      return {};
+    unsigned value;
+    auto [end, ec] = std::from_chars(s->data(), s->data() + s->size(), value);
+    if (ec != std::errc() || end != s->data() + s->size()) {
+      std::cerr << "error: the argument ('" << *s << "') for option '--"
+                << name << "' is invalid\n";
+      exit(EXIT_FAILURE);
+    }
+    return value;
+  };
+
+  auto optional_size = [&](const char *name) -> std::optional<size_t> {
+    auto s = optional_string(name);
+    if (!s)
+      return {};
+    size_t value;
+    auto [end, ec] = std::from_chars(s->data(), s->data() + s->size(), value);
+    const std::string_view suffix(end, s->data() + s->size());
+    int shift = suffix == ""    ? 0
+                : suffix == "K" ? 10
+                : suffix == "M" ? 20
+                : suffix == "G" ? 30
+                                : -1;
+    if (ec != std::errc() || shift < 0 || value > SIZE_MAX >> shift) {
+      std::cerr << "error: the argument ('" << *s << "') for option '--"
+                << name << "' is invalid\n";
+      exit(EXIT_FAILURE);
+    }
+    return value << shift;
+  };
+
+  const auto stale_days = optional_unsigned("stale");
+  // Like the ages of --since, the days must fit in the clock's duration or
+  // subtracting them from now wraps around.
+  constexpr auto longest_days = std::chrono::floor<std::chrono::days>(
+      std::chrono::system_clock::duration::max());
+  if (stale_days && *stale_days > longest_days.count()) {
+    std::cerr << "error: the argument ('" << *stale_days
+              << "') for option '--stale' is invalid\n";
+    exit(EXIT_FAILURE);
+  }
+  const bool prompt = values.contains("prompt");
+  unsigned n = optional_unsigned("count").value_or(stale_days ? 0u
+                                                   : prompt   ? 3u
+                                                              : 7u);
+
   return {
-      .n = vm["count"].as<unsigned>(),
-      .remote = vm.count("remote") > 0,
+      .n = n,
+      .remote = values.contains("remote"),
+      .all = values.contains("all"),
+      .progressive = values.contains("progressive"),
+      .pick = values.contains("pick"),
+      .stale_days = stale_days,
+      .base = optional_string("base").value_or("HEAD"),
+      .mine = values.contains("mine"),
+      .since = optional_string("since"),
+      .until = optional_string("until"),
+      .sort = optional_string("sort").value_or("time"),
+      .prompt = prompt,
+      .prefetch = values.contains("prefetch"),
+      .profile = values.contains("profile"),
+      .max_memory = optional_size("max-memory"),
+      .cache_size = optional_size("cache-size"),
+      .color = optional_string("color").value_or("auto"),
+      .absolute = values.contains("absolute"),
   };
 }
 
-std::tuple<std::vector<entry>, std::optional<error>>
-collect_branches(git_repository *repo, git_branch_t branch_type) {
-  std::vector<entry> branches;
+// Parses either an age relative to now, as a number followed by a unit, or
+// a YYYY-MM-DD date taken as midnight UTC.
+std::optional<std::chrono::system_clock::time_point>
+parse_time(const std::string &s, std::chrono::system_clock::time_point now) {
+  namespace c = std::chrono;
 
-  git_branch_iterator *branch_it = nullptr;
-  if (int err = git_branch_iterator_new(&branch_it, repo, branch_type); err)
-    return {branches, make_git_error()};
+  int year;
+  unsigned month, day;
+  char tail;
+  if (sscanf(s.c_str(), "%d-%u-%u%c", &year, &month, &day, &tail) == 3) {
+    const c::year_month_day ymd{c::year(year), c::month(month), c::day(day)};
+    if (!ymd.ok())
+      return {};
+    // Dates outside the clock's range, about 1677 to 2262 with libstdc++,
+    // are clamped to its ends, the conversion would wrap around.
+    using clock = c::system_clock;
+    constexpr auto earliest = c::ceil<c::days>(clock::time_point::min());
+    constexpr auto latest = c::floor<c::days>(clock::time_point::max());
+    const c::sys_days date(ymd);
+    if (date < earliest)
+      return clock::time_point::min();
+    if (date > latest)
+      return clock::time_point::max();
+    return date;
+  }
 
-  while (true) {
-    git_reference *ref = nullptr;
-    git_branch_t type;
-    if (int err = git_branch_next(&ref, &type, branch_it); err) {
-      if (err == GIT_ITEROVER)
-        break;
-      return {branches, make_git_error()};
-    }
+  // %lu would take a sign or leading spaces too.
+  unsigned long count;
+  int used = 0;
+  if (s.empty() || !isdigit(static_cast<unsigned char>(s[0])) ||
+      sscanf(s.c_str(), "%lu%n", &count, &used) != 1)
+    return {};
+
+  struct unit {
+    std::string_view suffix;
+    c::seconds length;
+  };
+  static constexpr unit units[] = {
+      {"s", c::seconds(1)}, {"m", c::minutes(1)}, {"h", c::hours(1)},
+      {"d", c::days(1)},    {"w", c::weeks(1)},   {"mo", c::months(1)},
+      {"y", c::years(1)},
+  };
 
-    git_object *obj = nullptr;
-    if (int err = git_reference_peel(&obj, ref, GIT_OBJECT_COMMIT); err)
-      return {branches, make_git_error()};
+  // Ages must fit in the clock's duration, about 292 years of nanoseconds
+  // with libstdc++, or subtracting them from now wraps around.
+  constexpr auto longest =
+      c::duration_cast<c::seconds>(c::system_clock::duration::max());
 
-    branches.emplace_back(ref, reinterpret_cast<git_commit *>(obj));
+  const std::string_view suffix = std::string_view(s).substr(size_t(used));
+  for (const auto &u : units) {
+    if (suffix != u.suffix)
+      continue;
+    if (count > static_cast<unsigned long>(longest / u.length))
+      return {};
+    return now - u.length * static_cast<c::seconds::rep>(count);
   }
+  return {};
+}
 
-  git_branch_iterator_free(branch_it);
+const char *head_marker(const entry &e) {
+  if (e.head)
+    return "* ";
+  return e.worktree_head ? "+ " : "  ";
+}
 
-  return {branches, {}};
+void free_entry(entry &e) {
+  git_commit_free(e.commit);
+  git_reference_free(e.ref);
 }
 
-// TODO: Is there a better way to do this?
-template <typename T>
-std::unique_ptr<T, void (*)(T *)> make_unique_with_deleter(auto *t, auto *d) {
-  return std::unique_ptr<T, void (*)(T *)>(t, d);
+using commit_ptr = std::unique_ptr<git_commit, void (*)(git_commit *)>;
+
+// The commit of an entry, looked up again if it was released, in which case
+// the returned pointer owns it.  Null if the lookup fails.
+commit_ptr entry_commit(git_repository *repo, const entry &e) {
+  if (e.commit)
+    return {e.commit, [](git_commit *) {}};
+  git_commit *commit = nullptr;
+  if (git_commit_lookup(&commit, repo, &e.commit_id) != 0)
+    commit = nullptr;
+  return {commit, git_commit_free};
 }
 
-std::optional<error> run(options opts) {
-  git_repository *repo_ = nullptr;
-  if (int err = git_repository_open_ext(&repo_, ".", 0, nullptr); err)
+// Append-only storage for the strings shown in rows, handed out as views
+// that stay valid as long as the arena: chunks are never reallocated.
+class string_arena {
+public:
+  std::string_view store(std::string_view s) {
+    if (chunks.empty() || chunks.back().capacity() - chunks.back().size() <
+                              s.size()) {
+      chunks.emplace_back();
+      chunks.back().reserve(std::max(chunk_size, s.size()));
+    }
+    auto &chunk = chunks.back();
+    const size_t at = chunk.size();
+    chunk.append(s);
+    return std::string_view(chunk).substr(at, s.size());
+  }
+
+  void clear() { chunks.clear(); }
+
+private:
+  static constexpr size_t chunk_size = 64 * 1024;
+
+  std::vector<std::string> chunks;
+};
+
+// Fills in the summary of every row.  Commits still held are read through
+// their message, released ones straight from the object database, without
+// parsing them into commit objects.
+std::optional<error> load_summaries(git_repository *repo,
+                                    std::span<entry> rows,
+                                    string_arena &arena) {
+  git_odb *odb_ = nullptr;
+  if (int err = git_repository_odb(&odb_, repo); err)
     return make_git_error();
+  auto odb = make_unique_with_deleter<git_odb>(odb_, git_odb_free);
 
-  auto repo =
-      make_unique_with_deleter<git_repository>(repo_, git_repository_free);
+  std::string summary;
+  for (auto &e : rows) {
+    const entry &latest =
+        e.upstream && e.upstream->commit_time > e.commit_time ? *e.upstream
+                                                              : e;
+    summary.clear();
+    if (latest.commit) {
+      append_summary(summary, git_commit_message(latest.commit));
+    } else {
+      git_odb_object *obj = nullptr;
+      if (int err = git_odb_read(&obj, odb.get(), &latest.commit_id); err)
+        return make_git_error();
+      append_summary(summary,
+                     raw_commit_message(
+                         {static_cast<const char *>(git_odb_object_data(obj)),
+                          git_odb_object_size(obj)}));
+      git_odb_object_free(obj);
+    }
+    e.summary = arena.store(summary);
+  }
+  return {};
+}
 
-  auto [branches, err] = collect_branches(
-      repo.get(), opts.remote ? GIT_BRANCH_REMOTE : GIT_BRANCH_LOCAL);
-  if (err)
-    return err;
+// Object reads for --profile, counted by a backend added ahead of the real
+// ones that passes every request on.  Requests only reach the backends when
+// libgit2's object cache misses.  Resolver threads mark themselves, so reads
+// of branch tips can be told apart from the ones done by walks.
+struct object_stats {
+  static inline std::atomic<size_t> tip_lookups = 0;
+  static inline std::atomic<size_t> tip_reads = 0;
+  static inline std::atomic<size_t> reads = 0;
+  static inline thread_local bool resolving_tips = false;
 
-  if (opts.n == 0 || opts.n > branches.size())
-    opts.n = branches.size();
+  static std::optional<error> install(git_repository *repo);
+};
 
-  std::ranges::partial_sort(
-      branches, branches.begin() + opts.n,
-      [](auto &a, auto &b) { return a.commit_time > b.commit_time; });
+std::optional<error> object_stats::install(git_repository *repo) {
+  static git_odb_backend counter = [] {
+    git_odb_backend b;
+    git_odb_init_backend(&b, GIT_ODB_BACKEND_VERSION);
+    b.read = [](void **, size_t *, git_object_t *, git_odb_backend *,
+                const git_oid *) {
+      reads++;
+      if (resolving_tips)
+        tip_reads++;
+      return int(GIT_PASSTHROUGH);
+    };
+    // Owned by no odb, nothing to free.
+    b.free = [](git_odb_backend *) {};
+    return b;
+  }();
 
-  auto recent = std::span(branches.begin(), opts.n);
+  git_odb *odb_ = nullptr;
+  if (int err = git_repository_odb(&odb_, repo); err)
+    return make_git_error();
+  auto odb = make_unique_with_deleter<git_odb>(odb_, git_odb_free);
+  if (int err = git_odb_add_backend(odb.get(), &counter, 1000); err)
+    return make_git_error();
+  return {};
+}
 
-  const size_t min_padding = 10;
-  auto max_branch_size = std::transform_reduce(
-      recent.begin(), recent.end(), min_padding,
-      [](auto a, auto b) { return std::max(a, b); },
-      [](auto &e) { return strlen(e.name); });
+// libgit2's object cache defaults to 256MiB and to not caching commits over
+// 4KiB.  Branch tips are read once and kept referenced, so the cache mostly
+// saves reads of tips shared by several branches and of commits looked up
+// again, and is sized from the number of branches: small for a prompt,
+// larger for full listings.  Trees are only read for a checkout, never
+// twice.
+void set_object_cache_limits(std::optional<size_t> fixed_size) {
+  git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJECT_COMMIT,
+                   size_t(16 * 1024));
+  git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJECT_TREE,
+                   size_t(0));
+  if (fixed_size == 0)
+    git_libgit2_opts(GIT_OPT_ENABLE_CACHING, 0);
+  else if (fixed_size)
+    git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, ssize_t(*fixed_size));
+}
 
-  auto now = std::chrono::system_clock::now();
+void size_object_cache(size_t refs, std::optional<size_t> limit) {
+  constexpr size_t per_ref = 2 * 1024;
+  constexpr size_t min_size = 1 << 20;
+  constexpr size_t max_size = 256 << 20;
+  size_t size = std::clamp(refs * per_ref, min_size, max_size);
+  if (limit)
+    size = std::min(size, *limit);
+  git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, ssize_t(size));
+}
 
-  for (const auto &e : recent) {
-    const auto duration = now - e.commit_time;
+// Number of branches to size the object cache for, known before
+// enumerating: the limit is a libgit2 global that the resolver threads read
+// unsynchronized, so it can't change while they run.  Large repositories
+// keep nearly all their refs in packed-refs, at roughly 64 bytes a line;
+// the few loose ones fit in the minimum cache size.
+size_t estimated_refs(git_repository *repo) {
+  std::error_code ec;
+  const auto size = std::filesystem::file_size(
+      std::filesystem::path(git_repository_commondir(repo)) / "packed-refs",
+      ec);
+  return ec ? 0 : size_t(size / 64);
+}
+
+// Work collect_branches does from the enumerating thread on each batch of
+// references, before the resolvers get to them.
+struct collect_hooks {
+  // Read-ahead hints for the commits of the batch.
+  const object_prefetcher *prefetcher = nullptr;
+};
+
+// Fixed capacity queue between pipeline stages, producers block while it is
+// full so a slow consumer bounds the work in flight.  Closed once every
+// producer is done, after which pop() drains what is left.
+template <typename T> class bounded_queue {
+public:
+  explicit bounded_queue(size_t capacity, size_t producers = 1)
+      : capacity(capacity), producers(producers) {}
+
+  // Returns false if the queue was cancelled, the item is left with the
+  // caller then.  It is only moved from once queued.
+  bool push(T &item) {
+    std::unique_lock lock(mutex);
+    not_full.wait(lock, [&] { return cancelled || items.size() < capacity; });
+    if (cancelled)
+      return false;
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  std::optional<T> pop() {
+    std::unique_lock lock(mutex);
+    not_empty.wait(lock, [&] { return !items.empty() || producers == 0; });
+    if (items.empty())
+      return {};
+    T item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return item;
+  }
+
+  void producer_done() {
+    std::lock_guard lock(mutex);
+    if (--producers == 0)
+      not_empty.notify_all();
+  }
+
+  // Wakes blocked producers, whatever is queued is left to drain.
+  void cancel() {
+    std::lock_guard lock(mutex);
+    cancelled = true;
+    not_full.notify_all();
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::deque<T> items;
+  size_t capacity;
+  size_t producers;
+  bool cancelled = false;
+};
+
+// Produces one entry per branch, handing ownership to the sink as soon as
+// the commit is resolved so the consumer can start selecting before the
+// enumeration is complete.
+//
+// Enumerating the references, reading their commits and the sink run
+// concurrently: a thread walks the references while a few resolver threads
+// peel them, which mostly waits on object reads when the repository is not
+// in the page cache.  The sink is only ever called from the calling thread.
+std::optional<error>
+collect_branches(git_repository *repo, git_branch_t branch_type,
+                 const std::function<void(entry)> &sink,
+                 const collect_hooks &hooks = {}) {
+  // Handed over in batches, per item locking costs more than peeling a
+  // reference whose commit is already cached.
+  constexpr size_t batch_size = 64;
+  constexpr size_t queue_size = 16;
+  const size_t resolvers =
+      std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 4);
+
+  bounded_queue<std::vector<git_reference *>> refs(queue_size);
+  bounded_queue<std::vector<entry>> resolved(queue_size, resolvers);
 
-    // clang-format off
-    std::cout << (git_branch_is_head(e.ref) ? "* " : "  ")
-              << std::left << std::setw(int(max_branch_size)) << e.name << "  "
-              << std::right << format_duration(duration) << "  "
-              << std::left << git_commit_summary(e.commit) << "\n";
-    // clang-format on
+  std::mutex err_mutex;
+  std::optional<error> err;
+  std::atomic<bool> failed = false;
+  auto fail = [&](error e) {
+    {
+      std::lock_guard lock(err_mutex);
+      if (!err)
+        err = std::move(e);
+    }
+    failed = true;
+    refs.cancel();
+    resolved.cancel();
+  };
+
+  {
+    // Joined at the end of the scope, before the error is returned.
+    std::jthread enumerator([&] {
+      git_branch_iterator *branch_it = nullptr;
+      if (git_branch_iterator_new(&branch_it, repo, branch_type)) {
+        fail(make_git_error());
+        refs.producer_done();
+        return;
+      }
+
+      std::vector<git_reference *> batch;
+      std::vector<git_oid> targets;
+      auto flush = [&] {
+        if (hooks.prefetcher) {
+          targets.clear();
+          for (auto *ref : batch)
+            if (auto *target = git_reference_target(ref))
+              targets.push_back(*target);
+          hooks.prefetcher->prefetch(targets);
+        }
+        // On cancellation the batch is freed below, with the rest.
+        if (!refs.push(batch))
+          return false;
+        batch.clear();
+        return true;
+      };
+
+      while (true) {
+        git_reference *ref = nullptr;
+        git_branch_t type;
+        if (int e = git_branch_next(&ref, &type, branch_it); e) {
+          if (e != GIT_ITEROVER)
+            fail(make_git_error());
+          else if (!batch.empty())
+            flush();
+          break;
+        }
+        batch.push_back(ref);
+        if (batch.size() == batch_size && !flush())
+          break;
+      }
+
+      std::ranges::for_each(batch, git_reference_free);
+      git_branch_iterator_free(branch_it);
+      refs.producer_done();
+    });
+
+    std::vector<std::jthread> resolver_threads;
+    for (size_t i = 0; i < resolvers; i++)
+      resolver_threads.emplace_back([&] {
+        object_stats::resolving_tips = true;
+        while (auto batch = refs.pop()) {
+          object_stats::tip_lookups += batch->size();
+          std::vector<entry> entries;
+          entries.reserve(batch->size());
+          for (auto *ref : *batch) {
+            git_object *obj = nullptr;
+            if (failed || git_reference_peel(&obj, ref, GIT_OBJECT_COMMIT)) {
+              if (!failed)
+                fail(make_git_error());
+              git_reference_free(ref);
+              continue;
+            }
+            entries.emplace_back(ref, reinterpret_cast<git_commit *>(obj));
+          }
+          if (!resolved.push(entries))
+            std::ranges::for_each(entries, free_entry);
+        }
+        resolved.producer_done();
+      });
+
+    while (auto batch = resolved.pop()) {
+      for (auto &e : *batch) {
+        if (failed)
+          free_entry(e);
+        else
+          sink(e);
+      }
+    }
+  }
+
+  return err;
+}
+
+// Reference names of the branches checked out in the main worktree and in
+// every linked worktree.  The HEAD files are read directly from the common
+// directory instead of opening a repository per worktree.
+std::unordered_set<std::string> worktree_heads(git_repository *repo) {
+  namespace fs = std::filesystem;
+
+  std::unordered_set<std::string> heads;
+  auto read_head = [&](const fs::path &head_path) {
+    std::ifstream in(head_path);
+    std::string line;
+    if (std::getline(in, line) && line.starts_with("ref: "))
+      heads.insert(line.substr(5));
+  };
+
+  const fs::path common = git_repository_commondir(repo);
+  read_head(common / "HEAD");
+
+  std::error_code ec;
+  for (const auto &wt : fs::directory_iterator(common / "worktrees", ec))
+    read_head(wt.path() / "HEAD");
+
+  return heads;
+}
+
+// Reference name of the branch checked out in the current worktree, looked
+// up once instead of a git_branch_is_head() per row, which reads HEAD.
+std::string current_head(git_repository *repo) {
+  git_reference *head_ = nullptr;
+  if (git_repository_head(&head_, repo))
+    return {};
+  auto head =
+      make_unique_with_deleter<git_reference>(head_, git_reference_free);
+  return git_reference_name(head.get());
+}
+
+struct oid_hash {
+  size_t operator()(const git_oid &id) const {
+    // Object ids are already uniformly distributed.
+    size_t h;
+    memcpy(&h, id.id, sizeof(h));
+    return h;
+  }
+};
+
+struct oid_equal {
+  bool operator()(const git_oid &a, const git_oid &b) const {
+    return git_oid_equal(&a, &b);
   }
+};
+
+using oid_set = std::unordered_set<git_oid, oid_hash, oid_equal>;
+
+// Answers whether commits are reachable from a base commit.  The history of
+// the base is walked once, instead of calling git_graph_descendant_of() per
+// branch.  When the repository has a pack bitmap, the walk stops at every
+// commit with a stored bitmap and uses it instead of walking its history,
+// otherwise the walk stops as soon as every commit of interest was seen.
+class reachability {
+public:
+  static std::tuple<reachability, std::optional<error>>
+  compute(git_repository *repo, const git_oid &base,
+          std::span<const git_oid> targets);
+
+  bool reachable(const git_oid &id) const { return found.contains(id); }
+
+private:
+  std::optional<error> walk_with_bitmaps(git_repository *repo,
+                                         const pack_bitmap &bitmaps,
+                                         const git_oid &base,
+                                         std::span<const git_oid> targets);
+
+  oid_set found;
+};
 
-  for (auto &e : branches) {
-    git_commit_free(e.commit);
-    git_reference_free(e.ref);
+std::optional<error> reachability::walk_with_bitmaps(
+    git_repository *repo, const pack_bitmap &bitmaps, const git_oid &base,
+    std::span<const git_oid> targets) {
+  bitmap reach;
+  std::vector<git_oid> queue{base};
+  oid_set seen{base};
+
+  while (!queue.empty()) {
+    const git_oid id = queue.back();
+    queue.pop_back();
+
+    if (const bitmap *b = bitmaps.reachable_from(id)) {
+      reach |= *b;
+      continue;
+    }
+    found.insert(id);
+
+    git_commit *commit_ = nullptr;
+    if (int err = git_commit_lookup(&commit_, repo, &id); err)
+      return make_git_error();
+    auto commit =
+        make_unique_with_deleter<git_commit>(commit_, git_commit_free);
+
+    for (unsigned i = 0; i < git_commit_parentcount(commit.get()); i++) {
+      const git_oid &parent = *git_commit_parent_id(commit.get(), i);
+      if (seen.insert(parent).second)
+        queue.push_back(parent);
+    }
   }
 
+  for (const auto &t : targets)
+    if (auto pos = bitmaps.position(t); pos && reach.test(*pos))
+      found.insert(t);
+
   return {};
 }
 
-} // namespace
+std::tuple<reachability, std::optional<error>>
+reachability::compute(git_repository *repo, const git_oid &base,
+                      std::span<const git_oid> targets) {
+  reachability r;
 
-int main(int argc, char *argv[]) {
-  auto opts = parse_options(argc, argv);
+  const std::filesystem::path objects =
+      std::filesystem::path(git_repository_commondir(repo)) / "objects";
+  if (auto bitmaps = find_pack_bitmap(objects)) {
+    auto err = r.walk_with_bitmaps(repo, *bitmaps, base, targets);
+    return {std::move(r), err};
+  }
+
+  oid_set pending(targets.begin(), targets.end());
+
+  git_revwalk *walk_ = nullptr;
+  if (int err = git_revwalk_new(&walk_, repo); err)
+    return {std::move(r), make_git_error()};
+  auto walk = make_unique_with_deleter<git_revwalk>(walk_, git_revwalk_free);
+
+  // No sorting: the order doesn't matter, and it lets the walk stream.
+  git_revwalk_sorting(walk.get(), GIT_SORT_NONE);
+  if (int err = git_revwalk_push(walk.get(), &base); err)
+    return {std::move(r), make_git_error()};
+
+  git_oid id;
+  while (!pending.empty()) {
+    if (int err = git_revwalk_next(&id, walk.get()); err) {
+      if (err == GIT_ITEROVER)
+        break;
+      return {std::move(r), make_git_error()};
+    }
+    if (pending.erase(id))
+      r.found.insert(id);
+  }
+
+  return {std::move(r), {}};
+}
+
+// Finds the most recent commit authored by a given email in the history of
+// each branch.  The answer is kept on every commit it is computed for, so
+// history common to many branches is only walked once per run, and the
+// number of commits read in a run is bounded.
+class authored_history {
+public:
+  // Commits older than not_before are neither considered nor walked past.
+  authored_history(git_repository *repo, std::string email,
+                   std::chrono::system_clock::time_point not_before)
+      : repo(repo), email(std::move(email)),
+        oldest(std::chrono::duration_cast<std::chrono::seconds>(
+                   not_before.time_since_epoch())
+                   .count()) {}
+
+  // Commit time of the most recent commit by the email reachable from the
+  // tip.  Commits that can't be read (e.g. in shallow clones), or that are
+  // past the read limit, end the walk along that path.
+  std::optional<std::chrono::system_clock::time_point>
+  last_commit(const git_oid &tip);
+
+private:
+  struct node {
+    git_time_t time;
+    bool mine;
+    std::vector<git_oid> parents;
+    // Newest commit by the email among this one and its ancestors, valid
+    // once resolved.
+    std::optional<git_time_t> newest;
+    bool resolved = false;
+  };
+
+  node *load(const git_oid &id);
+
+  static constexpr size_t read_limit = 100000;
+
+  git_repository *repo;
+  std::string email;
+  git_time_t oldest;
+  std::unordered_map<git_oid, std::optional<node>, oid_hash, oid_equal> nodes;
+};
+
+authored_history::node *authored_history::load(const git_oid &id) {
+  if (auto it = nodes.find(id); it != nodes.end())
+    return it->second ? &*it->second : nullptr;
+  if (nodes.size() >= read_limit)
+    return nullptr;
+
+  auto &slot = nodes[id];
+  git_commit *commit_ = nullptr;
+  if (git_commit_lookup(&commit_, repo, &id) != 0)
+    return nullptr;
+  auto commit = make_unique_with_deleter<git_commit>(commit_, git_commit_free);
+
+  node n{
+      .time = git_commit_time(commit.get()),
+      .mine = email == git_commit_author(commit.get())->email,
+      .parents = {},
+  };
+  for (unsigned i = 0; i < git_commit_parentcount(commit.get()); i++)
+    n.parents.push_back(*git_commit_parent_id(commit.get(), i));
+
+  return &*(slot = std::move(n));
+}
+
+std::optional<std::chrono::system_clock::time_point>
+authored_history::last_commit(const git_oid &tip) {
+  node *root = load(tip);
+  if (!root || root->time < oldest)
+    return {};
+
+  // Depth first, a commit is resolved once all its parents are.  Parents
+  // on the stack are never reached again, the history has no cycles.
+  std::vector<std::pair<node *, size_t>> stack;
+  if (!root->resolved)
+    stack.emplace_back(root, 0);
+  while (!stack.empty()) {
+    auto [n, next] = stack.back();
+    if (next < n->parents.size()) {
+      stack.back().second++;
+      node *p = load(n->parents[next]);
+      if (p && !p->resolved && p->time >= oldest)
+        stack.emplace_back(p, 0);
+      continue;
+    }
+
+    if (n->mine)
+      n->newest = n->time;
+    for (const auto &parent : n->parents) {
+      auto it = nodes.find(parent);
+      if (it == nodes.end() || !it->second || it->second->time < oldest)
+        continue;
+      if (auto t = it->second->newest; t && (!n->newest || *t > *n->newest))
+        n->newest = t;
+    }
+    n->resolved = true;
+    stack.pop_back();
+  }
+
+  if (!root->newest)
+    return {};
+  return std::chrono::system_clock::time_point{
+      std::chrono::seconds(*root->newest)};
+}
+
+std::tuple<git_oid, std::optional<error>> resolve_commit(git_repository *repo,
+                                                         const char *spec) {
+  git_object *obj_ = nullptr;
+  if (int err = git_revparse_single(&obj_, repo, spec); err)
+    return {git_oid{}, make_git_error()};
+  auto obj = make_unique_with_deleter<git_object>(obj_, git_object_free);
+
+  git_object *commit_ = nullptr;
+  if (int err = git_object_peel(&commit_, obj.get(), GIT_OBJECT_COMMIT); err)
+    return {git_oid{}, make_git_error()};
+  auto commit = make_unique_with_deleter<git_object>(commit_, git_object_free);
+
+  return {*git_object_id(commit.get()), {}};
+}
+
+// Owns entries that are displayed as part of another entry's row.
+struct entry_pool {
+  entry_pool() = default;
+  entry_pool(const entry_pool &) = delete;
+  entry_pool &operator=(const entry_pool &) = delete;
+
+  ~entry_pool() {
+    for (auto &e : entries)
+      free_entry(e);
+  }
+
+  std::vector<entry> entries;
+};
+
+// Upstream of every local branch, loaded once per run from a config
+// snapshot by iterating branch.*.remote, branch.*.merge and remote.*.fetch.
+// This keeps upstream lookups O(config size) overall instead of doing
+// config lookups per branch like git_branch_upstream() does.
+class upstream_table {
+public:
+  static std::tuple<upstream_table, std::optional<error>>
+  load(git_repository *repo);
+
+  // Reference name of the upstream of a local branch reference, or null if
+  // it has none.
+  const std::string *find(const char *refname) const {
+    auto it = upstreams.find(refname);
+    return it != upstreams.end() ? &it->second : nullptr;
+  }
+
+private:
+  std::unordered_map<std::string, std::string> upstreams;
+};
+
+std::tuple<upstream_table, std::optional<error>>
+upstream_table::load(git_repository *repo) {
+  upstream_table table;
+
+  git_config *cfg_ = nullptr;
+  if (int err = git_repository_config_snapshot(&cfg_, repo); err)
+    return {std::move(table), make_git_error()};
+  auto cfg = make_unique_with_deleter<git_config>(cfg_, git_config_free);
+
+  git_config_iterator *it_ = nullptr;
+  if (int err = git_config_iterator_glob_new(
+          &it_, cfg.get(),
+          "^(branch\\..*\\.(remote|merge)|remote\\..*\\.fetch)$");
+      err)
+    return {std::move(table), make_git_error()};
+  auto it = make_unique_with_deleter<git_config_iterator>(
+      it_, git_config_iterator_free);
+
+  struct tracking {
+    std::string remote;
+    std::string merge;
+  };
+  std::unordered_map<std::string, tracking> branches;
+  std::unordered_map<std::string, std::vector<std::string>> fetch_specs;
+
+  git_config_entry *ce = nullptr;
+  while (git_config_next(&ce, it.get()) == 0) {
+    // Branch and remote names may contain dots, the variable is after the
+    // last one.
+    std::string_view key = ce->name;
+    const bool is_branch = key.starts_with("branch.");
+    key.remove_prefix(is_branch ? strlen("branch.") : strlen("remote."));
+    const auto dot = key.rfind('.');
+    std::string name(key.substr(0, dot));
+    const auto var = key.substr(dot + 1);
+
+    if (!is_branch)
+      fetch_specs[name].emplace_back(ce->value);
+    else if (var == "remote")
+      branches[name].remote = ce->value;
+    else
+      branches[name].merge = ce->value;
+  }
+
+  // Parsed once per remote, not once per branch tracking it.
+  std::unordered_map<std::string, std::vector<git_refspec *>> refspecs;
+  for (auto &[remote, specs] : fetch_specs) {
+    auto &parsed = refspecs[remote];
+    for (auto &s : specs) {
+      git_refspec *spec = nullptr;
+      if (git_refspec_parse(&spec, s.c_str(), true) == 0)
+        parsed.push_back(spec);
+    }
+  }
+
+  for (auto &[name, t] : branches) {
+    if (t.remote.empty() || t.merge.empty())
+      continue;
+
+    std::string refname = "refs/heads/" + name;
+    if (t.remote == ".") {
+      table.upstreams.emplace(std::move(refname), t.merge);
+      continue;
+    }
+
+    auto specs = refspecs.find(t.remote);
+    if (specs == refspecs.end())
+      continue;
+    for (auto *spec : specs->second) {
+      if (!git_refspec_src_matches(spec, t.merge.c_str()))
+        continue;
+      git_buf buf = GIT_BUF_INIT;
+      if (git_refspec_transform(&buf, spec, t.merge.c_str()) == 0)
+        table.upstreams.emplace(std::move(refname), buf.ptr);
+      git_buf_dispose(&buf);
+      break;
+    }
+  }
+
+  for (auto &[remote, specs] : refspecs)
+    for (auto *spec : specs)
+      git_refspec_free(spec);
+
+  return {std::move(table), {}};
+}
+
+// Folds each remote-tracking branch that is the upstream of a local branch
+// into that local branch's row.  Folded entries move to the tracking pool,
+// all the others are handed to the sink.
+void pair_with_upstreams(std::vector<entry> branches,
+                         const upstream_table &upstreams, entry_pool &tracking,
+                         const std::function<void(entry)> &sink) {
+  std::unordered_map<std::string_view, size_t> by_refname;
+  for (size_t i = 0; i < branches.size(); i++)
+    by_refname.emplace(git_reference_name(branches[i].ref), i);
+
+  // Several local branches may track the same remote one.
+  std::vector<std::optional<size_t>> upstream_of(branches.size());
+  std::unordered_map<size_t, size_t> folded;
+  for (size_t i = 0; i < branches.size(); i++) {
+    if (git_reference_is_remote(branches[i].ref))
+      continue;
+    auto *up = upstreams.find(git_reference_name(branches[i].ref));
+    if (!up)
+      continue;
+    auto remote = by_refname.find(*up);
+    if (remote == by_refname.end() ||
+        !git_reference_is_remote(branches[remote->second].ref))
+      continue;
+    upstream_of[i] = remote->second;
+    folded.emplace(remote->second, 0);
+  }
 
-  git_libgit2_init();
+  tracking.entries.reserve(tracking.entries.size() + folded.size());
+  for (auto &[index, slot] : folded) {
+    slot = tracking.entries.size();
+    tracking.entries.push_back(branches[index]);
+  }
+
+  for (size_t i = 0; i < branches.size(); i++) {
+    if (folded.contains(i))
+      continue;
+    if (upstream_of[i])
+      branches[i].upstream = &tracking.entries[folded[*upstream_of[i]]];
+    sink(branches[i]);
+  }
+}
+
+// Keeps the N most recent entries seen so far, freeing the others as soon
+// as they fall out.  While bounded, the entries are kept as a min-heap on
+// commit time so the oldest candidate is always the one to be replaced.
+class recent_set {
+public:
+  explicit recent_set(size_t n) : n(n) {}
+
+  recent_set(const recent_set &) = delete;
+  recent_set &operator=(const recent_set &) = delete;
+
+  ~recent_set() {
+    for (auto &e : entries)
+      free_entry(e);
+  }
+
+  // Returns whether the set of most recent entries changed.
+  bool add(entry e) {
+    if (n == 0) {
+      entries.push_back(e);
+      return true;
+    }
+
+    if (entries.size() < n) {
+      entries.push_back(e);
+      std::ranges::push_heap(entries, newer);
+      return true;
+    }
+
+    if (!newer(e, entries.front())) {
+      free_entry(e);
+      return false;
+    }
+
+    std::ranges::pop_heap(entries, newer);
+    free_entry(entries.back());
+    entries.back() = e;
+    std::ranges::push_heap(entries, newer);
+    return true;
+  }
+
+  // Most recent first, then by name.
+  std::span<entry> sorted() {
+    if (n == 0)
+      radix_sort();
+    else
+      std::ranges::sort(entries, newer);
+    return entries;
+  }
+
+  // The limit entries with the smallest keys, in key order, freeing the
+  // others.  Keys are computed from all entries at once, so this is only
+  // valid when every entry was kept, i.e. N was zero.
+  std::span<entry>
+  select(size_t limit,
+         const std::function<std::vector<uint64_t>(std::span<const entry>)>
+             &make_keys);
+
+  // Sorted copy of the first limit current candidates, leaving the heap
+  // untouched.
+  std::vector<entry> snapshot(size_t limit) const {
+    auto copy = entries;
+    limit = std::min(limit, copy.size());
+    std::ranges::partial_sort(copy, copy.begin() + ptrdiff_t(limit), newer);
+    copy.erase(copy.begin() + ptrdiff_t(limit), copy.end());
+    return copy;
+  }
+
+private:
+  static bool newer(const entry &a, const entry &b) {
+    if (a.last_activity() != b.last_activity())
+      return a.last_activity() > b.last_activity();
+    return strcmp(a.name, b.name) < 0;
+  }
+
+  static uint64_t seconds(const entry &e) {
+    return uint64_t(std::chrono::duration_cast<std::chrono::seconds>(
+                        e.last_activity().time_since_epoch())
+                        .count());
+  }
+
+  void radix_sort();
+
+  size_t n;
+  std::vector<entry> entries;
+};
+
+std::span<entry> recent_set::select(
+    size_t limit,
+    const std::function<std::vector<uint64_t>(std::span<const entry>)>
+        &make_keys) {
+  const auto keys = make_keys(entries);
+  std::vector<uint32_t> order(entries.size());
+  std::iota(order.begin(), order.end(), 0u);
+  limit = limit == 0 ? order.size() : std::min(limit, order.size());
+  std::ranges::partial_sort(order, order.begin() + ptrdiff_t(limit), {},
+                            [&](uint32_t i) { return keys[i]; });
+
+  std::vector<entry> selected;
+  selected.reserve(limit);
+  for (size_t i = 0; i < limit; i++)
+    selected.push_back(entries[order[i]]);
+  for (size_t i = limit; i < order.size(); i++)
+    free_entry(entries[order[i]]);
+  entries = std::move(selected);
+  return entries;
+}
+
+// When every entry is listed, sort with an LSD radix sort instead of
+// comparing whole entries.  Each key packs the distance to the most recent
+// time above the entry index, so sorting keys ascending gives the most
+// recent first, and only the bytes covering the time are sorted since the
+// passes are stable.  Ties in time are then ordered by name.
+void recent_set::radix_sort() {
+  if (entries.size() < 2)
+    return;
+
+  const auto [lo, hi] = std::ranges::minmax(entries, {}, seconds);
+  const uint64_t latest = seconds(hi);
+  const int index_bits = std::bit_width(entries.size() - 1);
+  const int time_bits = std::bit_width(latest - seconds(lo));
+  if (index_bits + time_bits > 64) {
+    std::ranges::sort(entries, newer);
+    return;
+  }
+
+  std::vector<uint64_t> keys(entries.size());
+  for (size_t i = 0; i < entries.size(); i++)
+    keys[i] = (latest - seconds(entries[i])) << index_bits | i;
+
+  std::vector<uint64_t> scratch(keys.size());
+  for (int shift = index_bits; shift < index_bits + time_bits; shift += 8) {
+    std::array<size_t, 257> offsets{};
+    for (auto k : keys)
+      offsets[((k >> shift) & 0xff) + 1]++;
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    for (auto k : keys)
+      scratch[offsets[(k >> shift) & 0xff]++] = k;
+    keys.swap(scratch);
+  }
+
+  const uint64_t index_mask = (uint64_t(1) << index_bits) - 1;
+  std::vector<entry> sorted;
+  sorted.reserve(entries.size());
+  for (auto k : keys)
+    sorted.push_back(entries[k & index_mask]);
+  entries = std::move(sorted);
+
+  for (auto first = entries.begin(); first != entries.end();) {
+    auto last = std::find_if(first, entries.end(), [&](const entry &e) {
+      return e.last_activity() != first->last_activity();
+    });
+    if (last - first > 1)
+      std::sort(first, last, newer);
+    first = last;
+  }
+}
+
+// Escape sequences for colored output, spliced as they are into the output.
+namespace color {
+constexpr std::string_view reset = "\033[m";
+constexpr std::string_view head = "\033[32m";
+constexpr std::string_view worktree = "\033[36m";
+constexpr std::string_view remote = "\033[31m";
+
+// Ages up to each limit get the color next to it, older ones are dimmed.
+constexpr std::pair<std::chrono::hours, std::string_view> ages[] = {
+    {std::chrono::hours(24), "\033[1;32m"},
+    {std::chrono::hours(24 * 7), "\033[32m"},
+    {std::chrono::hours(24 * 30), "\033[33m"},
+};
+constexpr std::string_view old_age = "\033[2m";
+
+std::string_view for_name(const entry &e) {
+  if (e.head)
+    return head;
+  if (e.worktree_head)
+    return worktree;
+  return git_reference_is_remote(e.ref) ? remote : std::string_view();
+}
+
+std::string_view for_age(std::chrono::system_clock::duration age) {
+  for (const auto &[limit, escape] : ages)
+    if (age <= limit)
+      return escape;
+  return old_age;
+}
+} // namespace color
+
+std::tuple<bool, std::optional<error>> use_color(const std::string &when) {
+  if (when == "always")
+    return {true, {}};
+  if (when == "never")
+    return {false, {}};
+  if (when != "auto")
+    return {false, error{"invalid --color value '" + when + "'"}};
+  const char *no_color = getenv("NO_COLOR");
+  return {isatty(STDOUT_FILENO) && !(no_color && *no_color), {}};
+}
+
+// Length of the ASCII prefix of s, looking at eight bytes at a time.
+size_t ascii_prefix(std::string_view s) {
+  size_t i = 0;
+  for (; i + 8 <= s.size(); i += 8) {
+    uint64_t word;
+    memcpy(&word, s.data() + i, 8);
+    if (word & 0x8080808080808080)
+      break;
+  }
+  while (i < s.size() && !(static_cast<unsigned char>(s[i]) & 0x80))
+    i++;
+  return i;
+}
+
+// Decodes the UTF-8 sequence at s[i] and moves i past it.  Invalid bytes
+// decode one at a time as U+FFFD.
+char32_t decode_utf8(std::string_view s, size_t &i) {
+  const auto byte = [&](size_t k) { return static_cast<unsigned char>(s[k]); };
+  const unsigned char lead = byte(i);
+  const size_t length = lead < 0x80           ? 1
+                        : (lead & 0xE0) == 0xC0 ? 2
+                        : (lead & 0xF0) == 0xE0 ? 3
+                        : (lead & 0xF8) == 0xF0 ? 4
+                                                : 0;
+  if (length == 0 || i + length > s.size()) {
+    i++;
+    return U'\uFFFD';
+  }
+  char32_t c = length == 1 ? lead : lead & (0x7F >> length);
+  for (size_t k = 1; k < length; k++) {
+    if ((byte(i + k) & 0xC0) != 0x80) {
+      i++;
+      return U'\uFFFD';
+    }
+    c = c << 6 | (byte(i + k) & 0x3F);
+  }
+  i += length;
+  return c;
+}
+
+// Terminal columns taken by a code point: none for combining marks and
+// other zero width characters, two for East Asian wide and fullwidth ones
+// and for emoji, one otherwise.
+unsigned code_point_width(char32_t c) {
+  using range = std::pair<char32_t, char32_t>;
+  static constexpr range zero_width[] = {
+      {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x0610, 0x061A},
+      {0x064B, 0x065F}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x1AB0, 0x1AFF},
+      {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x20D0, 0x20FF}, {0xFE00, 0xFE0F},
+      {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF},
+  };
+  static constexpr range wide[] = {
+      {0x1100, 0x115F},   {0x2E80, 0x303E},   {0x3041, 0x33FF},
+      {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},   {0xA000, 0xA4CF},
+      {0xAC00, 0xD7A3},   {0xF900, 0xFAFF},   {0xFE30, 0xFE4F},
+      {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x1F300, 0x1F64F},
+      {0x1F900, 0x1F9FF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+  };
+  auto in = [c](std::span<const range> table) {
+    auto it = std::ranges::upper_bound(table, c, {}, &range::first);
+    return it != table.begin() && c <= std::prev(it)->second;
+  };
+  if (c < 0x300)
+    return 1;
+  if (in(zero_width))
+    return 0;
+  return in(wide) ? 2 : 1;
+}
+
+size_t display_width(std::string_view s) {
+  size_t i = ascii_prefix(s);
+  size_t width = i;
+  while (i < s.size())
+    width += code_point_width(decode_utf8(s, i));
+  return width;
+}
+
+// Appends at most cols terminal columns of s, never splitting a UTF-8
+// sequence, and returns the columns taken.  Text that doesn't fit ends with
+// an ellipsis when asked to.
+size_t append_clipped(std::string &out, std::string_view s, size_t cols,
+                      bool ellipsis = false) {
+  const size_t ascii = ascii_prefix(s);
+  if (ascii == s.size() && s.size() <= cols) {
+    out.append(s);
+    return s.size();
+  }
+
+  // Where to cut should s not fit, leaving room for the ellipsis.  Up to
+  // the end of the ASCII prefix, bytes and columns are the same.
+  const size_t room = ellipsis && cols > 0 ? cols - 1 : cols;
+  size_t cut = std::min(ascii, room);
+  size_t cut_width = cut;
+  // Saturating, cols is SIZE_MAX when there is no limit.
+  size_t i = std::min(ascii, cols == SIZE_MAX ? cols : cols + 1);
+  size_t width = i;
+  while (width <= cols && i < s.size()) {
+    width += code_point_width(decode_utf8(s, i));
+    if (width <= room) {
+      cut = i;
+      cut_width = width;
+    }
+  }
+
+  if (width <= cols) {
+    out.append(s);
+    return width;
+  }
+  out.append(s.substr(0, cut));
+  if (ellipsis && cols > 0) {
+    out.append("\u2026");
+    cut_width++;
+  }
+  return cut_width;
+}
+
+// Columns of the terminal fd is attached to, zero when it isn't one.
+size_t terminal_columns(int fd) {
+  winsize ws{};
+  if (ioctl(fd, TIOCGWINSZ, &ws) != 0)
+    return 0;
+  return ws.ws_col;
+}
+
+// Rows of the terminal fd is attached to, zero when it isn't one.
+size_t terminal_rows(int fd) {
+  winsize ws{};
+  if (ioctl(fd, TIOCGWINSZ, &ws) != 0)
+    return 0;
+  return ws.ws_row;
+}
+
+// Formats commit times for the listing, as ages relative to a fixed now or,
+// for --absolute, as ISO 8601 local times like 2024-03-01T14:05:09+01:00.
+// Either way the width is fixed and the text lives in the formatter until
+// the next call.
+class time_formatter {
+public:
+  explicit time_formatter(bool absolute)
+      : absolute(absolute), now(std::chrono::system_clock::now()) {}
+
+  size_t width() const { return absolute ? iso_width : duration_width; }
+
+  std::string_view operator()(std::chrono::system_clock::time_point t) {
+    if (!absolute)
+      return format_duration(now - t, relative);
+    return format_iso(
+        std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch())
+            .count());
+  }
+
+private:
+  static constexpr size_t iso_width = 25;
+
+  std::string_view format_iso(int64_t t);
+  long utc_offset(int64_t t);
+
+  bool absolute;
+  std::chrono::system_clock::time_point now;
+  duration_buffer relative;
+  std::array<char, iso_width> iso;
+
+  // Offsets change on quarter hour boundaries at most, so localtime_r is
+  // only asked once per quarter hour, in a small direct mapped cache.
+  struct cached_offset {
+    int64_t slot = INT64_MIN;
+    long offset = 0;
+  };
+  std::array<cached_offset, 64> offsets;
+};
+
+long time_formatter::utc_offset(int64_t t) {
+  const int64_t slot = t >= 0 ? t / 900 : (t - 899) / 900;
+  auto &cached = offsets[size_t(slot) % offsets.size()];
+  if (cached.slot != slot) {
+    const time_t tt = time_t(t);
+    tm local{};
+    localtime_r(&tt, &local);
+    cached = {slot, local.tm_gmtoff};
+  }
+  return cached.offset;
+}
+
+std::string_view time_formatter::format_iso(int64_t t) {
+  namespace c = std::chrono;
+  const long offset = utc_offset(t);
+  const c::sys_seconds local{c::seconds(t + offset)};
+  const auto day = c::floor<c::days>(local);
+  const c::year_month_day ymd{day};
+  const c::hh_mm_ss time{local - day};
+
+  auto put = [](char *at, unsigned value, int digits) {
+    while (digits-- > 0) {
+      at[digits] = char('0' + value % 10);
+      value /= 10;
+    }
+  };
+  char *p = iso.data();
+  put(p, unsigned(int(ymd.year())), 4);
+  p[4] = '-';
+  put(p + 5, unsigned(ymd.month()), 2);
+  p[7] = '-';
+  put(p + 8, unsigned(ymd.day()), 2);
+  p[10] = 'T';
+  put(p + 11, unsigned(time.hours().count()), 2);
+  p[13] = ':';
+  put(p + 14, unsigned(time.minutes().count()), 2);
+  p[16] = ':';
+  put(p + 17, unsigned(time.seconds().count()), 2);
+  p[19] = offset < 0 ? '-' : '+';
+  const unsigned minutes = unsigned(std::abs(offset) / 60);
+  put(p + 20, minutes / 60, 2);
+  p[22] = ':';
+  put(p + 23, minutes % 60, 2);
+  return {iso.data(), iso.size()};
+}
+
+// How print_entries renders the rows.
+struct output_style {
+  bool colored = false;
+  bool absolute = false;
+};
+
+// Rows are laid out in a single buffer written at once.  On a terminal they
+// are truncated to its width, shortening names only as far as needed to
+// leave room for some of the summary; output to pipes is never truncated.
+void print_entries(std::span<const entry> recent, const output_style &style) {
+  const size_t min_padding = 10;
+  const size_t min_summary = 20;
+
+  // Measured once, the row loop below pads with them.
+  std::vector<size_t> name_widths(recent.size());
+  size_t max_branch_size = min_padding;
+  for (size_t i = 0; i < recent.size(); i++) {
+    name_widths[i] = display_width(recent[i].name);
+    max_branch_size = std::max(max_branch_size, name_widths[i]);
+  }
+
+  // Only needed when some row is a local branch paired with its upstream.
+  const bool upstream_column =
+      std::ranges::any_of(recent, [](auto &e) { return e.upstream; });
+  const bool merged_column = std::ranges::any_of(
+      recent, [](auto &e) { return e.merged.has_value(); });
+
+  time_formatter times(style.absolute);
+  const size_t time_width = times.width();
+  const size_t fixed_columns = 2 + 2 + time_width + 2 +
+                               (upstream_column ? time_width + 2 : 0) +
+                               (merged_column ? 10 : 0);
+  const size_t cols = terminal_columns(STDOUT_FILENO);
+  size_t name_column = max_branch_size;
+  size_t summary_columns = SIZE_MAX;
+  if (cols > 0) {
+    const size_t reserved = fixed_columns + min_summary;
+    if (name_column + reserved > cols)
+      name_column =
+          std::max(min_padding, cols > reserved ? cols - reserved : 0);
+    summary_columns = cols - std::min(cols, fixed_columns + name_column);
+  }
+
+  const auto now = std::chrono::system_clock::now();
+
+  std::string out;
+  for (size_t i = 0; i < recent.size(); i++) {
+    const auto &e = recent[i];
+    const auto duration = now - e.commit_time;
+
+    // Escapes take no columns, padding is unaffected by them.
+    auto paint = [&](std::string_view escape, auto &&append) {
+      if (style.colored && !escape.empty()) {
+        out += escape;
+        append();
+        out += color::reset;
+      } else {
+        append();
+      }
+    };
+
+    size_t name_width = 0;
+    paint(color::for_name(e), [&] {
+      out += head_marker(e);
+      name_width = name_widths[i] <= name_column
+                       ? (out += e.name, name_widths[i])
+                       : append_clipped(out, e.name, name_column, true);
+    });
+    out.append(name_column - name_width + 2, ' ');
+    paint(color::for_age(duration), [&] { out += times(e.commit_time); });
+    out += "  ";
+
+    if (upstream_column) {
+      if (e.upstream) {
+        paint(color::for_age(now - e.upstream->commit_time),
+              [&] { out += times(e.upstream->commit_time); });
+        out += "  ";
+      } else {
+        out.append(time_width + 2, ' ');
+      }
+    }
+
+    if (merged_column)
+      out += e.merged.value_or(false) ? "merged    " : "unmerged  ";
+
+    // Not measured when nothing limits it, it's the last column.
+    if (summary_columns == SIZE_MAX)
+      out += e.summary;
+    else
+      append_clipped(out, e.summary, summary_columns, true);
+    out += '\n';
+  }
+  std::cout << out;
+}
+
+enum class sort_field { time, name, author, ahead };
+
+std::tuple<std::vector<sort_field>, std::optional<error>>
+parse_sort(const std::string &spec) {
+  static constexpr std::pair<std::string_view, sort_field> names[] = {
+      {"time", sort_field::time},
+      {"name", sort_field::name},
+      {"author", sort_field::author},
+      {"ahead", sort_field::ahead},
+  };
+
+  std::vector<sort_field> fields;
+  std::string_view rest = spec;
+  while (!rest.empty()) {
+    const auto comma = rest.find(',');
+    const auto word = rest.substr(0, comma);
+    rest = comma == rest.npos ? "" : rest.substr(comma + 1);
+
+    auto it = std::ranges::find_if(
+        names, [&](auto &n) { return n.first == word; });
+    if (it == std::end(names))
+      return {fields, error{"invalid sort key '" + std::string(word) + "'"}};
+    if (std::ranges::find(fields, it->second) == fields.end())
+      fields.push_back(it->second);
+  }
+
+  // Names are unique, so nothing after them matters and no row ties.
+  if (auto name = std::ranges::find(fields, sort_field::name);
+      name != fields.end())
+    fields.erase(name + 1, fields.end());
+  else
+    fields.push_back(sort_field::name);
+
+  return {fields, {}};
+}
+
+// Dense rank of each row under the given order, rows that compare equal
+// share a rank.
+std::vector<uint32_t> dense_ranks(size_t count, auto less) {
+  std::vector<uint32_t> order(count);
+  std::iota(order.begin(), order.end(), 0u);
+  std::ranges::sort(order, less);
+
+  std::vector<uint32_t> ranks(count);
+  uint32_t rank = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0 && less(order[i - 1], order[i]))
+      rank++;
+    ranks[order[i]] = rank;
+  }
+  return ranks;
+}
+
+// Number of commits each local branch is ahead of its upstream, zero for
+// branches without one.
+std::vector<size_t> ahead_counts(git_repository *repo,
+                                 std::span<const entry> rows,
+                                 const upstream_table &upstreams) {
+  std::vector<size_t> ahead(rows.size());
+  for (size_t i = 0; i < rows.size(); i++) {
+    auto *up = upstreams.find(git_reference_name(rows[i].ref));
+    git_oid up_id;
+    size_t behind;
+    if (!up || git_reference_name_to_id(&up_id, repo, up->c_str()) != 0 ||
+        git_graph_ahead_behind(&ahead[i], &behind, repo,
+                               &rows[i].commit_id, &up_id) != 0)
+      ahead[i] = 0;
+  }
+  return ahead;
+}
+
+// Packs the rank of each row under every sort field into a single integer,
+// most significant field first, so ordering rows is one integer compare.
+// Should the ranks not fit in 64 bits, the key is the row's position in a
+// lexicographic sort of its ranks instead.
+std::vector<uint64_t> pack_sort_keys(git_repository *repo,
+                                     std::span<const entry> rows,
+                                     std::span<const sort_field> fields,
+                                     const upstream_table &upstreams) {
+  if (rows.empty())
+    return {};
+
+  std::vector<std::vector<uint32_t>> ranks;
+  for (auto field : fields) {
+    switch (field) {
+    case sort_field::time:
+      ranks.push_back(dense_ranks(rows.size(), [&](uint32_t a, uint32_t b) {
+        return rows[a].last_activity() > rows[b].last_activity();
+      }));
+      break;
+    case sort_field::name:
+      ranks.push_back(dense_ranks(rows.size(), [&](uint32_t a, uint32_t b) {
+        return strcmp(rows[a].name, rows[b].name) < 0;
+      }));
+      break;
+    case sort_field::author: {
+      std::vector<std::string> authors(rows.size());
+      for (size_t i = 0; i < rows.size(); i++)
+        if (auto commit = entry_commit(repo, rows[i]))
+          authors[i] = git_commit_author(commit.get())->name;
+      ranks.push_back(dense_ranks(rows.size(), [&](uint32_t a, uint32_t b) {
+        return authors[a] < authors[b];
+      }));
+      break;
+    }
+    case sort_field::ahead: {
+      auto ahead = ahead_counts(repo, rows, upstreams);
+      ranks.push_back(dense_ranks(rows.size(), [&](uint32_t a, uint32_t b) {
+        return ahead[a] > ahead[b];
+      }));
+      break;
+    }
+    }
+  }
+
+  std::vector<int> bits;
+  for (auto &r : ranks)
+    bits.push_back(std::bit_width(std::ranges::max(r)));
+  const int total = std::reduce(bits.begin(), bits.end());
+
+  std::vector<uint64_t> keys(rows.size());
+  if (total <= 64) {
+    for (size_t i = 0; i < rows.size(); i++)
+      for (size_t f = 0; f < ranks.size(); f++)
+        keys[i] = keys[i] << bits[f] | ranks[f][i];
+    return keys;
+  }
+
+  std::vector<uint32_t> order(rows.size());
+  std::iota(order.begin(), order.end(), 0u);
+  std::ranges::sort(order, [&](uint32_t a, uint32_t b) {
+    for (auto &r : ranks)
+      if (r[a] != r[b])
+        return r[a] < r[b];
+    return false;
+  });
+  for (size_t pos = 0; pos < order.size(); pos++)
+    keys[order[pos]] = pos;
+  return keys;
+}
+
+// Redraws the current candidates over the previously drawn ones, at most
+// once per interval, so the terminal is not flooded on big repositories.
+class progressive_printer {
+public:
+  progressive_printer(git_repository *repo, output_style style)
+      : repo(repo), style(style) {}
+
+  void update(const recent_set &set) {
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_draw < interval)
+      return;
+    last_draw = now;
+
+    // Rows scrolled off the screen can't be redrawn, so the drawing is
+    // kept within it, leaving a line for the cursor.
+    const size_t rows = terminal_rows(STDOUT_FILENO);
+    auto current = set.snapshot(rows > 1 ? rows - 1 : 1);
+    arena.clear();
+    if (load_summaries(repo, current, arena))
+      return;
+    clear();
+    print_entries(current, style);
+    std::cout << std::flush;
+    lines_drawn = current.size();
+  }
+
+  // Erases what was drawn so the final listing can take its place.
+  void clear() {
+    if (lines_drawn > 0)
+      std::cout << "\r\033[" << lines_drawn << "A\033[J";
+    lines_drawn = 0;
+  }
+
+private:
+  static constexpr auto interval = std::chrono::milliseconds(100);
+
+  git_repository *repo;
+  output_style style;
+  string_arena arena;
+  std::chrono::steady_clock::time_point last_draw{};
+  size_t lines_drawn = 0;
+};
+
+// Scores how well the query matches the name for --pick.  Every query
+// character must appear in order (case-insensitively); consecutive matches
+// and matches at the start of a path component score higher.
+std::optional<int> fuzzy_score(std::string_view query, std::string_view name) {
+  int score = 0;
+  size_t pos = 0;
+  bool previous_matched = false;
+
+  for (char q : query) {
+    const char lq = char(std::tolower(static_cast<unsigned char>(q)));
+    bool found = false;
+    for (; pos < name.size(); pos++) {
+      const char c = char(std::tolower(static_cast<unsigned char>(name[pos])));
+      if (c != lq) {
+        previous_matched = false;
+        continue;
+      }
+      score += 1;
+      if (previous_matched)
+        score += 4;
+      if (pos == 0 || name[pos - 1] == '/' || name[pos - 1] == '-' ||
+          name[pos - 1] == '_')
+        score += 3;
+      previous_matched = true;
+      found = true;
+      pos++;
+      break;
+    }
+    if (!found)
+      return {};
+  }
+
+  return score;
+}
+
+// Puts the controlling terminal in raw mode for the lifetime of the object.
+class raw_terminal {
+public:
+  raw_terminal() : fd(open("/dev/tty", O_RDWR | O_CLOEXEC)) {
+    if (fd < 0 || tcgetattr(fd, &saved) != 0)
+      return;
+
+    termios raw = saved;
+    raw.c_lflag &= ~tcflag_t(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_iflag &= ~tcflag_t(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSAFLUSH, &raw) == 0)
+      active = true;
+
+    // Alternate screen, so the previous contents are restored on exit.
+    write("\033[?1049h");
+  }
+
+  raw_terminal(const raw_terminal &) = delete;
+  raw_terminal &operator=(const raw_terminal &) = delete;
+
+  ~raw_terminal() {
+    if (active) {
+      write("\033[?1049l");
+      tcsetattr(fd, TCSAFLUSH, &saved);
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool ok() const { return active; }
+
+  unsigned short rows() const {
+    winsize ws{};
+    if (ioctl(fd, TIOCGWINSZ, &ws) != 0 || ws.ws_row == 0)
+      return 24;
+    return ws.ws_row;
+  }
+
+  unsigned short cols() const {
+    winsize ws{};
+    if (ioctl(fd, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0)
+      return 80;
+    return ws.ws_col;
+  }
+
+  void write(std::string_view s) const {
+    while (!s.empty()) {
+      auto w = ::write(fd, s.data(), s.size());
+      if (w <= 0)
+        return;
+      s.remove_prefix(size_t(w));
+    }
+  }
+
+  enum key : int { none = -1, up = 256, down, escape };
+
+  int read_key() const {
+    unsigned char c;
+    if (::read(fd, &c, 1) != 1)
+      return none;
+    if (c != 27)
+      return c;
+
+    // A lone escape is "cancel", otherwise parse the arrow keys.
+    pollfd pfd{.fd = fd, .events = POLLIN, .revents = 0};
+    if (poll(&pfd, 1, 25) <= 0)
+      return escape;
+    unsigned char seq[2];
+    if (::read(fd, &seq[0], 1) != 1 || ::read(fd, &seq[1], 1) != 1)
+      return escape;
+    if (seq[0] == '[' && seq[1] == 'A')
+      return up;
+    if (seq[0] == '[' && seq[1] == 'B')
+      return down;
+    return none;
+  }
+
+private:
+  int fd;
+  termios saved{};
+  bool active = false;
+};
+
+std::optional<error> checkout_branch(git_repository *repo, const entry &e) {
+  // Checked before touching the working tree: libgit2 only refuses when
+  // setting HEAD, after the checkout already rewrote the files.
+  if (e.worktree_head && !e.head)
+    return error{"'" + std::string(e.name) +
+                 "' is already checked out in another worktree"};
+
+  git_checkout_options checkout_opts;
+  git_checkout_options_init(&checkout_opts, GIT_CHECKOUT_OPTIONS_VERSION);
+  checkout_opts.checkout_strategy = GIT_CHECKOUT_SAFE;
+
+  auto commit = entry_commit(repo, e);
+  if (!commit)
+    return make_git_error();
+  if (int err = git_checkout_tree(
+          repo, reinterpret_cast<const git_object *>(commit.get()),
+          &checkout_opts);
+      err)
+    return make_git_error();
+
+  // Like git-checkout, remote branches leave HEAD detached.
+  if (git_reference_is_remote(e.ref)) {
+    if (int err = git_repository_set_head_detached(repo, &e.commit_id); err)
+      return make_git_error();
+    char id[8];
+    git_oid_tostr(id, sizeof(id), &e.commit_id);
+    std::cerr << "HEAD is now at " << id << " " << e.summary << "\n";
+    return {};
+  }
+
+  if (int err = git_repository_set_head(repo, git_reference_name(e.ref)); err)
+    return make_git_error();
+  std::cerr << "Switched to branch '" << e.name << "'\n";
+  return {};
+}
+
+// Interactive picker: typing narrows the list with fuzzy matching over the
+// branch names, Up/Down (or C-p/C-n) move the selection, Enter picks the
+// selected entry and Escape (or C-c/C-g) cancels, returning no entry.
+std::tuple<const entry *, std::optional<error>>
+pick_entry(std::span<const entry> rows, bool absolute) {
+  raw_terminal term;
+  if (!term.ok())
+    return {nullptr, error{"--pick requires a terminal"}};
+
+  // Rows are formatted once up front, each keystroke only filters them.
+  std::vector<std::string> lines;
+  lines.reserve(rows.size());
+  {
+    time_formatter times(absolute);
+    const size_t min_padding = 10;
+    auto max_branch_size = std::transform_reduce(
+        rows.begin(), rows.end(), min_padding,
+        [](auto a, auto b) { return std::max(a, b); },
+        [](auto &e) { return display_width(e.name); });
+    for (const auto &e : rows) {
+      std::string line = head_marker(e);
+      line += e.name;
+      line.append(max_branch_size - display_width(e.name) + 2, ' ');
+      line += times(e.commit_time);
+      line += "  ";
+      line += e.summary;
+      lines.push_back(std::move(line));
+    }
+  }
+
+  std::string query;
+  std::vector<size_t> all(rows.size());
+  std::iota(all.begin(), all.end(), 0);
+  std::vector<size_t> matches = all;
+  std::vector<std::pair<int, size_t>> scored;
+  size_t selected = 0;
+
+  auto refilter = [&](const std::vector<size_t> &candidates) {
+    scored.clear();
+    for (size_t i : candidates)
+      if (auto score = fuzzy_score(query, rows[i].name))
+        scored.emplace_back(-*score, i);
+    // Best score first, recency (the original order) breaks ties.
+    std::ranges::sort(scored);
+    matches.clear();
+    for (auto [score, i] : scored)
+      matches.push_back(i);
+    selected = 0;
+  };
+
+  std::string screen;
+  while (true) {
+    const size_t height = std::max(term.rows(), (unsigned short)2) - 1u;
+    const size_t width = term.cols();
+    const size_t first = selected >= height ? selected - height + 1 : 0;
+
+    screen.clear();
+    screen += "\033[H\033[2J";
+    for (size_t row = first; row < matches.size() && row < first + height;
+         row++) {
+      if (row == selected)
+        screen += "\033[7m";
+      append_clipped(screen, lines[matches[row]], width);
+      if (row == selected)
+        screen += "\033[m";
+      screen += "\n";
+    }
+    screen += "\033[" + std::to_string(height + 1) + ";1H";
+    screen += std::to_string(matches.size()) + "/" +
+              std::to_string(rows.size()) + " > ";
+    append_clipped(screen, query, width);
+    term.write(screen);
+
+    const int key = term.read_key();
+    switch (key) {
+    case raw_terminal::none:
+      break;
+    case raw_terminal::escape:
+    case 3:  // C-c
+    case 7:  // C-g
+      return {nullptr, {}};
+    case '\r':
+    case '\n':
+      if (!matches.empty())
+        return {&rows[matches[selected]], {}};
+      break;
+    case raw_terminal::up:
+    case 16:  // C-p
+      if (selected > 0)
+        selected--;
+      break;
+    case raw_terminal::down:
+    case 14:  // C-n
+      if (selected + 1 < matches.size())
+        selected++;
+      break;
+    case 127:
+    case 8:
+      if (!query.empty()) {
+        query.pop_back();
+        refilter(all);
+      }
+      break;
+    default:
+      if (key >= 32 && key < 256) {
+        // Appending can only narrow the matches, so only those are rescored.
+        query.push_back(char(key));
+        refilter(matches);
+      }
+      break;
+    }
+  }
+}
+
+std::optional<error> pick_branch(git_repository *repo,
+                                 std::span<const entry> rows, bool absolute) {
+  auto [chosen, err] = pick_entry(rows, absolute);
+  if (err)
+    return err;
+  if (!chosen)
+    return {};
+  return checkout_branch(repo, *chosen);
+}
+
+std::tuple<std::string, std::optional<error>>
+user_email(git_repository *repo) {
+  git_config *cfg_ = nullptr;
+  if (int err = git_repository_config_snapshot(&cfg_, repo); err)
+    return {"", make_git_error()};
+  auto cfg = make_unique_with_deleter<git_config>(cfg_, git_config_free);
+
+  const char *email = nullptr;
+  if (git_config_get_string(&email, cfg.get(), "user.email") != 0)
+    return {"", error{"--mine requires user.email to be configured"}};
+  return {email, {}};
+}
+
+// Memory allocated by libgit2, tracked through its allocator hook for
+// --profile and --max-memory.  Sizes come from malloc_usable_size, so blocks
+// need no header and stay compatible with plain free.
+struct memory_usage {
+  static inline std::atomic<size_t> current = 0;
+  static inline std::atomic<size_t> peak = 0;
+  static inline std::atomic<size_t> allocations = 0;
+
+  // Has to be called before libgit2 is initialized.
+  static void install();
+
+private:
+  static void *added(void *p) {
+    if (p) {
+      const size_t now =
+          current.fetch_add(malloc_usable_size(p), std::memory_order_relaxed) +
+          malloc_usable_size(p);
+      size_t seen = peak.load(std::memory_order_relaxed);
+      while (now > seen &&
+             !peak.compare_exchange_weak(seen, now, std::memory_order_relaxed))
+        ;
+      allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return p;
+  }
+
+  static void removed(void *p) {
+    if (p)
+      current.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+  }
+
+  static void *resized(void *p, size_t size) {
+    removed(p);
+    void *q = realloc(p, size);
+    // A failed realloc leaves the original block allocated.
+    return added(q ? q : (size ? p : nullptr));
+  }
+
+  static char *copied(const char *s, size_t n) {
+    auto *p = static_cast<char *>(added(malloc(n + 1)));
+    if (p) {
+      memcpy(p, s, n);
+      p[n] = '\0';
+    }
+    return p;
+  }
+
+  static size_t product(size_t a, size_t b) {
+    size_t n;
+    return __builtin_mul_overflow(a, b, &n) ? SIZE_MAX : n;
+  }
+};
+
+void memory_usage::install() {
+  static git_allocator allocator = {
+      .gmalloc = [](size_t n, const char *, int) { return added(malloc(n)); },
+      .gcalloc = [](size_t nelem, size_t elsize, const char *,
+                    int) { return added(calloc(nelem, elsize)); },
+      .gstrdup = [](const char *s, const char *,
+                    int) { return copied(s, strlen(s)); },
+      .gstrndup = [](const char *s, size_t n, const char *,
+                     int) { return copied(s, strnlen(s, n)); },
+      .gsubstrdup = [](const char *s, size_t n, const char *,
+                       int) { return copied(s, n); },
+      .grealloc = [](void *p, size_t size, const char *,
+                     int) { return resized(p, size); },
+      .greallocarray = [](void *p, size_t nelem, size_t elsize, const char *,
+                          int) { return resized(p, product(nelem, elsize)); },
+      .gmallocarray = [](size_t nelem, size_t elsize, const char *,
+                         int) { return added(malloc(product(nelem, elsize))); },
+      .gfree =
+          [](void *p) {
+            removed(p);
+            free(p);
+          },
+  };
+  git_libgit2_opts(GIT_OPT_SET_ALLOCATOR, &allocator);
+}
+
+// Reports the time taken, libgit2's memory use and how well its object
+// cache did on stderr when a run ends, for --profile.
+class profile_report {
+public:
+  // The cache is emptied with the repository, so it is sampled before.
+  void sample_cache() {
+    ssize_t used = 0, allowed = 0;
+    git_libgit2_opts(GIT_OPT_GET_CACHED_MEMORY, &used, &allowed);
+    cache_used = size_t(used);
+    cache_allowed = size_t(allowed);
+  }
+
+  ~profile_report() {
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const double mib = 1024.0 * 1024.0;
+    std::cerr << std::fixed << std::setprecision(1)
+              << "git-recent: " << elapsed.count() << " ms, libgit2 peak "
+              << double(memory_usage::peak) / mib << " MiB in "
+              << memory_usage::allocations << " allocations\n";
+
+    const size_t lookups = object_stats::tip_lookups;
+    const size_t tip_reads = std::min<size_t>(object_stats::tip_reads, lookups);
+    const double hits =
+        lookups ? 100.0 * double(lookups - tip_reads) / double(lookups) : 0;
+    std::cerr << "git-recent: object cache " << double(cache_used) / mib
+              << " of " << double(cache_allowed) / mib << " MiB, " << lookups
+              << " tips with " << tip_reads << " reads (" << hits
+              << "% hits), " << object_stats::reads << " reads in total\n";
+  }
+
+private:
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  size_t cache_used = 0;
+  size_t cache_allowed = 0;
+};
+
+// libgit2 is only initialized when a repository is actually opened, so the
+// paths served without it (like a --prompt cache hit) skip its global setup.
+bool libgit2_initialized = false;
+
+using repository_ptr =
+    std::unique_ptr<git_repository, void (*)(git_repository *)>;
+
+std::tuple<repository_ptr, std::optional<error>> open_repository() {
+  if (!libgit2_initialized) {
+    git_libgit2_init();
+    libgit2_initialized = true;
+  }
+
+  git_repository *repo_ = nullptr;
+  int err = git_repository_open_ext(&repo_, ".", 0, nullptr);
+  auto repo =
+      make_unique_with_deleter<git_repository>(repo_, git_repository_free);
+  if (err)
+    return {std::move(repo), make_git_error()};
+  return {std::move(repo), std::nullopt};
+}
+
+// Common git directory of the repository containing the working directory,
+// found without libgit2 so the prompt cache can be checked before opening
+// the repository.  Honors GIT_DIR, linked worktrees and bare repositories.
+std::optional<std::filesystem::path> find_common_dir() {
+  namespace fs = std::filesystem;
+
+  auto read_line = [](const fs::path &p) {
+    std::ifstream in(p);
+    std::string line;
+    std::getline(in, line);
+    return line;
+  };
+
+  std::error_code ec;
+  fs::path git_dir;
+  if (const char *env = getenv("GIT_DIR")) {
+    git_dir = fs::absolute(env, ec);
+  } else {
+    for (fs::path dir = fs::current_path(ec); !ec;) {
+      const fs::path dot_git = dir / ".git";
+      if (fs::is_directory(dot_git, ec)) {
+        git_dir = dot_git;
+        break;
+      }
+      if (fs::is_regular_file(dot_git, ec)) {
+        const auto line = read_line(dot_git);
+        if (line.starts_with("gitdir: "))
+          git_dir = dir / line.substr(strlen("gitdir: "));
+        break;
+      }
+      // Bare repository.
+      if (fs::is_regular_file(dir / "HEAD", ec) &&
+          fs::is_directory(dir / "objects", ec) &&
+          fs::is_directory(dir / "refs", ec)) {
+        git_dir = dir;
+        break;
+      }
+      if (dir == dir.root_path())
+        break;
+      dir = dir.parent_path();
+    }
+  }
+  if (git_dir.empty())
+    return {};
+
+  if (fs::exists(git_dir / "commondir", ec))
+    return (git_dir / read_line(git_dir / "commondir")).lexically_normal();
+  return git_dir.lexically_normal();
+}
+
+// Identifies the state of the local branches by the modification times of
+// packed-refs and of every directory under refs/heads.  Updating a loose
+// ref renames a lock file over it, which changes the time of its directory.
+std::string refs_stamp(const std::filesystem::path &common_dir) {
+  namespace fs = std::filesystem;
+
+  std::vector<fs::path> paths{"packed-refs", "refs/heads"};
+  std::error_code ec;
+  for (fs::recursive_directory_iterator it(common_dir / "refs/heads", ec), end;
+       !ec && it != end; it.increment(ec))
+    if (it->is_directory(ec))
+      paths.push_back(fs::relative(it->path(), common_dir, ec));
+  std::ranges::sort(paths);
+
+  std::string stamp;
+  for (const auto &p : paths) {
+    struct stat st;
+    if (stat((common_dir / p).c_str(), &st) != 0)
+      continue;
+    stamp += p.native() + " " + std::to_string(st.st_mtim.tv_sec) + "." +
+             std::to_string(st.st_mtim.tv_nsec) + ";";
+  }
+  return stamp;
+}
+
+// Most recent local branch names, with the refs stamp they were computed
+// for and the number of local branches there were.  Serialized as a header
+// line, the stamp line, the number of branches and a name per line, both
+// in the cache file and in the shared memory segment.
+struct prompt_cache {
+  static constexpr std::string_view header = "git-recent prompt cache 2";
+  static constexpr size_t size = 16;
+
+  // Whether the n most recent names are all there, fewer are only kept
+  // when there are fewer branches.
+  bool covers(size_t n) const { return names.size() >= std::min(n, branches); }
+
+  static std::optional<prompt_cache> parse(std::string_view data);
+  std::string serialize() const;
+
+  static std::optional<prompt_cache> read(const std::filesystem::path &path);
+  void write(const std::filesystem::path &path) const;
+
+  std::string stamp;
+  size_t branches = 0;
+  std::vector<std::string> names;
+};
+
+std::optional<prompt_cache> prompt_cache::parse(std::string_view data) {
+  auto next_line = [&]() -> std::optional<std::string_view> {
+    if (data.empty())
+      return {};
+    const auto nl = data.find('\n');
+    auto line = data.substr(0, nl);
+    data = nl == data.npos ? "" : data.substr(nl + 1);
+    return line;
+  };
+
+  if (next_line() != header)
+    return {};
+
+  prompt_cache cache;
+  auto stamp = next_line();
+  if (!stamp)
+    return {};
+  cache.stamp = *stamp;
+  auto branches = next_line();
+  if (!branches ||
+      std::from_chars(branches->data(), branches->data() + branches->size(),
+                      cache.branches)
+              .ptr != branches->data() + branches->size())
+    return {};
+  while (auto line = next_line())
+    cache.names.emplace_back(*line);
+  return cache;
+}
+
+std::string prompt_cache::serialize() const {
+  std::string out;
+  out.append(header).append("\n").append(stamp).append("\n");
+  out.append(std::to_string(branches)).append("\n");
+  for (const auto &name : names)
+    out.append(name).append("\n");
+  return out;
+}
+
+std::optional<prompt_cache>
+prompt_cache::read(const std::filesystem::path &path) {
+  std::ifstream in(path);
+  std::ostringstream contents;
+  contents << in.rdbuf();
+  if (!in)
+    return {};
+  return parse(contents.view());
+}
+
+// Written to a temporary file renamed over the cache, so concurrent readers
+// never see a partial cache.  Failing to write it is not an error.
+void prompt_cache::write(const std::filesystem::path &path) const {
+  auto tmp = path;
+  tmp += "." + std::to_string(getpid());
+  {
+    std::ofstream out(tmp);
+    out << serialize();
+    if (!out)
+      return;
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp, path, ec);
+  if (ec)
+    std::filesystem::remove(tmp, ec);
+}
+
+// Prompt cache shared by concurrent invocations through a POSIX shared
+// memory segment named after the common git directory.  Readers take
+// lock-free snapshots guarded by a sequence lock, and writers first claim
+// the rebuild, so when the refs change only one process recomputes the
+// cache while the others keep using the stale one.
+//
+// Segments outlive the processes using them, /dev/shm is a tmpfs that
+// keeps them until reboot, one per repository prompted in.  Only the pages
+// written take memory, usually a few KiB.  The segments of repositories
+// that no longer exist are unlinked on rebuilds.
+class shared_cache {
+public:
+  static std::optional<shared_cache>
+  open(const std::filesystem::path &common_dir);
+
+  shared_cache(shared_cache &&other) noexcept
+      : seg(std::exchange(other.seg, nullptr)),
+        common_dir(std::move(other.common_dir)),
+        claim(std::exchange(other.claim, 0)) {}
+  shared_cache &operator=(shared_cache &&) = delete;
+
+  ~shared_cache() {
+    if (seg)
+      munmap(seg, sizeof(segment));
+  }
+
+  std::optional<prompt_cache> read() const;
+
+  // Claims are considered abandoned after a while, in case the process
+  // holding one died, and can then be taken by another process.  Releasing
+  // a claim that was taken leaves the new one in place.
+  bool claim_rebuild();
+  void release_rebuild();
+
+  // Only to be called after claiming the rebuild.  Does nothing if the
+  // claim was taken by another process in the meantime.
+  void publish(const prompt_cache &cache);
+
+  // Unlinks the segments whose repository was removed.
+  static void remove_stale();
+
+private:
+  static constexpr size_t capacity = 64 * 1024;
+  static constexpr auto claim_timeout = std::chrono::seconds(10);
+
+  // The sequence number is odd while the data is being written.  The claim
+  // is the monotonic time it was made or last renewed at, which also tells
+  // claims apart, or 0.
+  struct segment {
+    std::atomic<uint64_t> seq;
+    std::atomic<int64_t> claimed_at;
+    uint32_t length;
+    char data[capacity];
+    // Common directory the segment is named after, for remove_stale().
+    char common_dir[PATH_MAX];
+  };
+  static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                std::atomic<int64_t>::is_always_lock_free);
+
+  shared_cache(segment *seg, std::string common_dir)
+      : seg(seg), common_dir(std::move(common_dir)) {}
+
+  static int64_t monotonic_now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+  }
+
+  segment *seg;
+  std::string common_dir;
+  // Value of claimed_at while this process holds the claim, 0 otherwise.
+  int64_t claim = 0;
+};
+
+std::optional<shared_cache>
+shared_cache::open(const std::filesystem::path &common_dir) {
+  // FNV-1a of the path, shared memory names can't contain slashes.
+  uint64_t hash = 0xcbf29ce484222325;
+  for (unsigned char c : common_dir.native())
+    hash = (hash ^ c) * 0x100000001b3;
+  char name[64];
+  snprintf(name, sizeof(name), "/git-recent-%016llx",
+           static_cast<unsigned long long>(hash));
+
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return {};
+
+  // A new segment is zero filled, which is a valid empty cache.
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t(st.st_size) < sizeof(segment) &&
+       ftruncate(fd, sizeof(segment)) != 0)) {
+    close(fd);
+    return {};
+  }
+
+  void *data =
+      mmap(nullptr, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return {};
+  return shared_cache(static_cast<segment *>(data), common_dir.native());
+}
+
+std::optional<prompt_cache> shared_cache::read() const {
+  std::string copy;
+  for (int attempt = 0; attempt < 100; attempt++) {
+    const uint64_t before = seg->seq.load(std::memory_order_acquire);
+    if (before & 1)
+      continue;
+
+    const uint32_t length = std::min<uint32_t>(seg->length, capacity);
+    copy.assign(seg->data, length);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seg->seq.load(std::memory_order_relaxed) == before)
+      return prompt_cache::parse(copy);
+  }
+  return {};
+}
+
+bool shared_cache::claim_rebuild() {
+  const int64_t now = monotonic_now();
+  int64_t claimed = seg->claimed_at.load(std::memory_order_acquire);
+  const int64_t timeout = std::chrono::nanoseconds(claim_timeout).count();
+  if (claimed != 0 && now - claimed < timeout)
+    return false;
+  if (!seg->claimed_at.compare_exchange_strong(claimed, now,
+                                               std::memory_order_acq_rel))
+    return false;
+  claim = now;
+  return true;
+}
+
+void shared_cache::release_rebuild() {
+  int64_t expected = std::exchange(claim, 0);
+  if (expected != 0)
+    seg->claimed_at.compare_exchange_strong(expected, 0,
+                                            std::memory_order_acq_rel);
+}
+
+void shared_cache::publish(const prompt_cache &cache) {
+  // Drop the least recent names should they not fit.
+  prompt_cache fitting = cache;
+  auto data = fitting.serialize();
+  while (data.size() > capacity && !fitting.names.empty()) {
+    fitting.names.pop_back();
+    data = fitting.serialize();
+  }
+  if (data.size() > capacity)
+    return;
+
+  // Renewed right before writing: a rebuild can outlast the timeout, and
+  // its result is dropped if another process took the claim meanwhile.
+  // Once renewed, the claim can only be taken from a writer stalled for the
+  // whole timeout in the middle of the copy.
+  int64_t expected = claim;
+  const int64_t renewed = monotonic_now();
+  if (expected == 0 ||
+      !seg->claimed_at.compare_exchange_strong(expected, renewed,
+                                               std::memory_order_acq_rel)) {
+    claim = 0;
+    return;
+  }
+  claim = renewed;
+
+  // Forced odd rather than incremented: a writer that died mid-publish
+  // leaves it odd, and incrementing would then flip the parity for good.
+  const uint64_t writing = seg->seq.load(std::memory_order_relaxed) | 1;
+  seg->seq.store(writing, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(seg->data, data.data(), data.size());
+  seg->length = uint32_t(data.size());
+  if (common_dir.size() < sizeof(seg->common_dir) &&
+      strncmp(seg->common_dir, common_dir.c_str(), sizeof(seg->common_dir)))
+    memcpy(seg->common_dir, common_dir.c_str(), common_dir.size() + 1);
+  seg->seq.store(writing + 1, std::memory_order_release);
+}
+
+void shared_cache::remove_stale() {
+  namespace fs = std::filesystem;
+
+  std::error_code ec;
+  for (const auto &f : fs::directory_iterator("/dev/shm", ec)) {
+    const std::string name = "/" + f.path().filename().native();
+    if (!name.starts_with("/git-recent-"))
+      continue;
+
+    int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+      continue;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(segment))
+      data = mmap(nullptr, sizeof(segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+      continue;
+
+    const char *other_dir = static_cast<const segment *>(data)->common_dir;
+    const std::string dir(other_dir, strnlen(other_dir, PATH_MAX));
+    munmap(data, sizeof(segment));
+
+    std::error_code exists_ec;
+    if (!dir.empty() && !fs::exists(dir, exists_ec) && !exists_ec)
+      shm_unlink(name.c_str());
+  }
+}
+
+void print_prompt(std::span<const std::string> names, size_t n) {
+  n = std::min(n, names.size());
+  for (size_t i = 0; i < n; i++)
+    std::cout << (i ? " " : "") << names[i];
+  std::cout << "\n";
+}
+
+// Rebuilds the cache file and, when given the shared cache whose rebuild
+// claim this process holds, publishes it there and releases the claim.
+std::tuple<prompt_cache, std::optional<error>>
+rebuild_prompt_cache(const std::filesystem::path &cache_path,
+                     std::string stamp, size_t n, shared_cache *claimed) {
+  prompt_cache cache{.stamp = std::move(stamp), .branches = 0, .names = {}};
+
+  auto rebuild = [&]() -> std::optional<error> {
+    auto [repo, open_err] = open_repository();
+    if (open_err)
+      return open_err;
+
+    set_object_cache_limits({});
+    size_object_cache(estimated_refs(repo.get()), {});
+    recent_set recent(std::max(n, prompt_cache::size));
+    auto err = collect_branches(repo.get(), GIT_BRANCH_LOCAL, [&](entry e) {
+      cache.branches++;
+      recent.add(e);
+    });
+    if (err)
+      return err;
+
+    for (const auto &e : recent.sorted())
+      cache.names.emplace_back(e.name);
+    cache.write(cache_path);
+    if (claimed) {
+      claimed->publish(cache);
+      shared_cache::remove_stale();
+    }
+    return {};
+  };
+
+  auto err = rebuild();
+  if (claimed)
+    claimed->release_rebuild();
+  return {cache, err};
+}
+
+// Shell prompt mode.  When the refs are unchanged since the cache was
+// written, the names come from it without opening the repository at all,
+// looking first at the shared memory segment and then at the cache file.
+// Otherwise one process claims the rebuild while concurrent ones print the
+// stale names.  If there is a stale cache to fall back to, the rebuild
+// happens in a child process: should it not finish within the budget, the
+// stale names are printed and the child completes the cache in the
+// background.  Caches holding fewer names than asked for are not used, the
+// names are then enumerated again.
+std::optional<error> run_prompt(const options &opts) {
+  const auto start = std::chrono::steady_clock::now();
+  constexpr auto budget = std::chrono::milliseconds(5);
+
+  auto common_dir = find_common_dir();
+  if (!common_dir)
+    return error{"not a git repository"};
+
+  const auto cache_path = *common_dir / "git-recent-cache";
+  auto stamp = refs_stamp(*common_dir);
+  const size_t n = opts.n == 0 ? prompt_cache::size : opts.n;
+
+  auto shared = shared_cache::open(*common_dir);
+  std::optional<prompt_cache> cached;
+  if (shared)
+    cached = shared->read();
+  if (cached && !cached->covers(n))
+    cached.reset();
+
+  if (!cached || cached->stamp != stamp) {
+    auto from_file = prompt_cache::read(cache_path);
+    if (from_file && from_file->covers(n) &&
+        (!cached || from_file->stamp == stamp)) {
+      cached = std::move(from_file);
+      // Let the next invocations find it in memory.
+      if (shared && cached->stamp == stamp && shared->claim_rebuild()) {
+        shared->publish(*cached);
+        shared->release_rebuild();
+      }
+    }
+  }
+
+  if (cached && cached->stamp == stamp) {
+    print_prompt(cached->names, n);
+    return {};
+  }
+
+  // Another process is already rebuilding, no point in doing it again.
+  shared_cache *claimed =
+      shared && shared->claim_rebuild() ? &*shared : nullptr;
+  if (shared && !claimed && cached) {
+    print_prompt(cached->names, n);
+    return {};
+  }
+
+  int fds[2];
+  if (!cached || pipe(fds) != 0) {
+    auto [fresh, err] =
+        rebuild_prompt_cache(cache_path, std::move(stamp), n, claimed);
+    if (err)
+      return err;
+    print_prompt(fresh.names, n);
+    return {};
+  }
+
+  const pid_t child = fork();
+  if (child == 0) {
+    // Nothing from the child should show up once the prompt is drawn.
+    close(fds[0]);
+    if (int null = open("/dev/null", O_RDWR); null >= 0) {
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+      close(null);
+    }
+    auto [fresh, err] =
+        rebuild_prompt_cache(cache_path, std::move(stamp), n, claimed);
+    if (!err) {
+      std::string line;
+      for (const auto &name : fresh.names)
+        line += name + "\n";
+      (void)!write(fds[1], line.data(), line.size());
+    }
+    _exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+  close(fds[1]);
+  if (child < 0 && claimed)
+    claimed->release_rebuild();
+
+  std::vector<std::string> names;
+  if (child > 0) {
+    // The child closes the pipe when done, success or not.
+    std::string received;
+    pollfd pfd{.fd = fds[0], .events = POLLIN, .revents = 0};
+    bool done = false;
+    while (!done) {
+      const auto left = budget - (std::chrono::steady_clock::now() - start);
+      const auto ms = std::chrono::ceil<std::chrono::milliseconds>(left);
+      if (ms.count() <= 0 || poll(&pfd, 1, int(ms.count())) <= 0)
+        break;
+      char buf[4096];
+      const auto r = read(fds[0], buf, sizeof(buf));
+      if (r <= 0)
+        done = true;
+      else
+        received.append(buf, size_t(r));
+    }
+
+    if (done) {
+      waitpid(child, nullptr, 0);
+      std::istringstream in(received);
+      for (std::string name; std::getline(in, name);)
+        names.push_back(name);
+    }
+  }
+  close(fds[0]);
+
+  print_prompt(names.empty() ? cached->names : names, n);
+  return {};
+}
+
+std::optional<error> run(options opts) {
+  if (opts.profile || opts.max_memory)
+    memory_usage::install();
+  std::optional<profile_report> report;
+  if (opts.profile)
+    report.emplace();
+
+  if (opts.prompt)
+    return run_prompt(opts);
+
+  auto [repo, open_err] = open_repository();
+  if (open_err)
+    return open_err;
+
+  if (report)
+    if (auto err = object_stats::install(repo.get()))
+      return err;
+
+  // Objects of released commits would otherwise stay in libgit2's cache.
+  std::optional<size_t> cache_limit;
+  if (opts.max_memory)
+    cache_limit = *opts.max_memory / 4;
+  set_object_cache_limits(opts.cache_size);
+  if (!opts.cache_size)
+    size_object_cache(estimated_refs(repo.get()), cache_limit);
+  collect_hooks hooks;
+  auto over_memory_cap = [&] {
+    return opts.max_memory && memory_usage::current > *opts.max_memory;
+  };
+
+  auto [sort_fields, sort_err] = parse_sort(opts.sort);
+  if (sort_err)
+    return sort_err;
+  auto [colored, color_err] = use_color(opts.color);
+  if (color_err)
+    return color_err;
+
+  // The default order is selected while enumerating, any other order needs
+  // every row before ranking them.
+  const bool custom_sort =
+      sort_fields != std::vector{sort_field::time, sort_field::name};
+
+  upstream_table upstreams;
+  if (opts.all || std::ranges::count(sort_fields, sort_field::ahead)) {
+    auto [table, config_err] = upstream_table::load(repo.get());
+    if (config_err)
+      return config_err;
+    upstreams = std::move(table);
+  }
+
+  // Declared first so it outlives the rows that point into it.
+  entry_pool tracking;
+  recent_set recent(custom_sort ? 0 : opts.n);
+
+  std::optional<progressive_printer> progress;
+  if (opts.progressive && opts.n > 0 && !opts.pick && !custom_sort &&
+      isatty(STDOUT_FILENO))
+    progress.emplace(repo.get(), output_style{colored, opts.absolute});
+
+  const auto stale_cutoff =
+      std::chrono::system_clock::now() -
+      std::chrono::days(opts.stale_days.value_or(0));
+
+  auto add = [&](entry e) {
+    if (opts.stale_days && e.last_activity() > stale_cutoff) {
+      free_entry(e);
+      return;
+    }
+    if (over_memory_cap())
+      e.release_commit();
+    if (recent.add(e) && progress)
+      progress->update(recent);
+  };
+
+  // Remote branches can't be checked out, no need to look at worktrees.
+  std::unordered_set<std::string> heads;
+  std::string head;
+  if (opts.all || !opts.remote) {
+    heads = worktree_heads(repo.get());
+    head = current_head(repo.get());
+  }
+
+  using time_point = std::chrono::system_clock::time_point;
+  const auto now = std::chrono::system_clock::now();
+  auto window_limit = [&](const std::optional<std::string> &s,
+                          time_point fallback)
+      -> std::tuple<time_point, std::optional<error>> {
+    if (!s)
+      return {fallback, {}};
+    if (auto t = parse_time(*s, now))
+      return {*t, {}};
+    return {fallback, error{"invalid time '" + *s + "'"}};
+  };
+  auto [since, since_err] = window_limit(opts.since, time_point::min());
+  if (since_err)
+    return since_err;
+  auto [until, until_err] = window_limit(opts.until, time_point::max());
+  if (until_err)
+    return until_err;
+
+  std::optional<authored_history> authored;
+  if (opts.mine) {
+    auto [email, email_err] = user_email(repo.get());
+    if (email_err)
+      return email_err;
+    authored.emplace(repo.get(), std::move(email), since);
+  }
+
+  // Applied to every branch as soon as its commit is resolved, before it
+  // takes part in any selection, returns whether to keep it.
+  auto keep = [&](entry &e) {
+    if (authored) {
+      auto last = authored->last_commit(e.commit_id);
+      if (!last)
+        return false;
+      e.commit_time = *last;
+    }
+    if (e.commit_time < since || e.commit_time > until)
+      return false;
+    e.head = head == git_reference_name(e.ref);
+    e.worktree_head = heads.contains(git_reference_name(e.ref));
+    return true;
+  };
+
+  std::optional<object_prefetcher> prefetcher;
+  if (opts.prefetch) {
+    prefetcher.emplace(object_prefetcher::open(
+        std::filesystem::path(git_repository_commondir(repo.get())) /
+        "objects"));
+    hooks.prefetcher = &*prefetcher;
+  }
+
+  std::optional<error> err;
+  if (opts.all) {
+    // Pairs are only known once every branch has been seen.
+    entry_pool all;
+    err = collect_branches(
+        repo.get(), GIT_BRANCH_ALL,
+        [&](entry e) {
+          if (!keep(e)) {
+            free_entry(e);
+            return;
+          }
+          if (over_memory_cap())
+            e.release_commit();
+          all.entries.push_back(e);
+        },
+        hooks);
+    if (!err)
+      pair_with_upstreams(std::exchange(all.entries, {}), upstreams,
+                          tracking, add);
+  } else {
+    err = collect_branches(
+        repo.get(), opts.remote ? GIT_BRANCH_REMOTE : GIT_BRANCH_LOCAL,
+        [&](entry e) {
+          if (keep(e))
+            add(e);
+          else
+            free_entry(e);
+        },
+        hooks);
+  }
+  if (err)
+    return err;
+  if (report)
+    report->sample_cache();
+
+  if (progress)
+    progress->clear();
+
+  std::span<entry> rows;
+  if (custom_sort)
+    rows = recent.select(opts.n, [&](auto all) {
+      return pack_sort_keys(repo.get(), all, sort_fields, upstreams);
+    });
+  else
+    rows = recent.sorted();
+
+  if (opts.stale_days) {
+    auto [base, base_err] = resolve_commit(repo.get(), opts.base.c_str());
+    if (base_err)
+      return base_err;
+
+    std::vector<git_oid> tips;
+    tips.reserve(rows.size());
+    for (auto &e : rows)
+      tips.push_back(e.commit_id);
+
+    auto [merged, walk_err] = reachability::compute(repo.get(), base, tips);
+    if (walk_err)
+      return walk_err;
+    for (auto &e : rows)
+      e.merged = merged.reachable(e.commit_id);
+  }
+
+  string_arena arena;
+  if (auto err = load_summaries(repo.get(), rows, arena))
+    return err;
+
+  if (opts.pick)
+    return pick_branch(repo.get(), rows, opts.absolute);
+
+  print_entries(rows, {.colored = colored, .absolute = opts.absolute});
+
+  return {};
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  auto opts = parse_options(argc, argv);
 
   if (auto err = run(opts); err) {
     std::cerr << "error: " << err->msg << "\n";
     return EXIT_FAILURE;
   }
 
-  git_libgit2_shutdown();
+  if (libgit2_initialized)
+    git_libgit2_shutdown();
   return 0;
 }
@@ -0,0 +1,518 @@
+// Copyright (c) 2022 Caio Oliveira
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "pack.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <numeric>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+namespace {
+
+uint32_t be32(const unsigned char *p) {
+  return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 |
+         uint32_t(p[3]);
+}
+
+uint64_t be64(const unsigned char *p) {
+  return uint64_t(be32(p)) << 32 | be32(p + 4);
+}
+
+const size_t oid_size = 20;
+
+} // namespace
+
+std::optional<mapped_file>
+mapped_file::open(const std::filesystem::path &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return {};
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return {};
+  }
+
+  void *data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return {};
+
+  return mapped_file(data, size_t(st.st_size));
+}
+
+mapped_file::mapped_file(mapped_file &&other) noexcept
+    : data(std::exchange(other.data, nullptr)),
+      size(std::exchange(other.size, 0)) {}
+
+mapped_file &mapped_file::operator=(mapped_file &&other) noexcept {
+  std::swap(data, other.data);
+  std::swap(size, other.size);
+  return *this;
+}
+
+mapped_file::~mapped_file() {
+  if (data)
+    munmap(data, size);
+}
+
+std::optional<pack_index> pack_index::open(const std::filesystem::path &path) {
+  auto file = mapped_file::open(path);
+  if (!file)
+    return {};
+
+  auto bytes = file->bytes();
+  const size_t header = 8 + 256 * 4;
+  if (bytes.size() < header + 2 * oid_size ||
+      memcmp(bytes.data(), "\377tOc", 4) != 0 || be32(bytes.data() + 4) != 2)
+    return {};
+
+  pack_index index(std::move(*file));
+  const unsigned char *p = bytes.data();
+  index.fanout = p + 8;
+  index.count = be32(index.fanout + 255 * 4);
+
+  // Ids, CRCs and 32-bit offsets, then the large offsets and two checksums.
+  const size_t fixed = header + size_t(index.count) * (oid_size + 4 + 4);
+  if (bytes.size() < fixed + 2 * oid_size)
+    return {};
+  const size_t large = bytes.size() - fixed - 2 * oid_size;
+  if (large % 8 != 0)
+    return {};
+
+  index.ids = p + header;
+  index.offsets = index.ids + size_t(index.count) * (oid_size + 4);
+  index.large_offsets = p + fixed;
+  index.large_offset_count = large / 8;
+  return index;
+}
+
+std::optional<uint32_t> pack_index::find(const git_oid &id) const {
+  const unsigned first = id.id[0];
+  uint32_t lo = first == 0 ? 0 : be32(fanout + (first - 1) * 4);
+  uint32_t hi = be32(fanout + first * 4);
+  if (hi > count || lo > hi)
+    return {};
+
+  while (lo < hi) {
+    const uint32_t mid = lo + (hi - lo) / 2;
+    const int cmp = memcmp(ids + size_t(mid) * oid_size, id.id, oid_size);
+    if (cmp == 0)
+      return mid;
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return {};
+}
+
+git_oid pack_index::id(uint32_t pos) const {
+  git_oid out;
+  memcpy(out.id, ids + size_t(pos) * oid_size, oid_size);
+  return out;
+}
+
+uint64_t pack_index::offset(uint32_t pos) const {
+  const uint32_t off = be32(offsets + size_t(pos) * 4);
+  if (!(off & 0x80000000u))
+    return off;
+
+  const size_t large = off & 0x7fffffffu;
+  if (large >= large_offset_count)
+    return 0;
+  return be64(large_offsets + large * 8);
+}
+
+std::span<const unsigned char, 20> pack_index::pack_checksum() const {
+  auto bytes = file.bytes();
+  return std::span<const unsigned char, 20>(
+      bytes.data() + bytes.size() - 2 * oid_size, oid_size);
+}
+
+std::vector<uint32_t> pack_order(const pack_index &index,
+                                 const std::filesystem::path &idx_path) {
+  std::vector<uint32_t> order(index.size());
+
+  // The reverse index has a 12 byte header, one entry per object and the
+  // two checksums.
+  auto rev_path = idx_path;
+  rev_path.replace_extension(".rev");
+  if (auto rev = mapped_file::open(rev_path)) {
+    auto bytes = rev->bytes();
+    const size_t expected = 12 + size_t(index.size()) * 4 + 2 * oid_size;
+    if (bytes.size() == expected && memcmp(bytes.data(), "RIDX", 4) == 0 &&
+        be32(bytes.data() + 4) == 1) {
+      bool valid = true;
+      for (uint32_t i = 0; i < index.size(); i++) {
+        order[i] = be32(bytes.data() + 12 + size_t(i) * 4);
+        valid &= order[i] < index.size();
+      }
+      if (valid)
+        return order;
+    }
+  }
+
+  std::iota(order.begin(), order.end(), 0u);
+  std::ranges::sort(order, {}, [&](uint32_t pos) { return index.offset(pos); });
+  return order;
+}
+
+void bitmap::set(size_t pos) {
+  if (pos / 64 >= words.size())
+    words.resize(pos / 64 + 1);
+  words[pos / 64] |= uint64_t(1) << (pos % 64);
+}
+
+size_t bitmap::count() const {
+  size_t n = 0;
+  for (auto w : words)
+    n += size_t(std::popcount(w));
+  return n;
+}
+
+size_t bitmap::count_and(const bitmap &other) const {
+  size_t n = 0;
+  const size_t common = std::min(words.size(), other.words.size());
+  for (size_t i = 0; i < common; i++)
+    n += size_t(std::popcount(words[i] & other.words[i]));
+  return n;
+}
+
+bitmap &bitmap::operator|=(const bitmap &other) {
+  if (other.words.size() > words.size())
+    words.resize(other.words.size());
+  for (size_t i = 0; i < other.words.size(); i++)
+    words[i] |= other.words[i];
+  return *this;
+}
+
+bitmap &bitmap::operator^=(const bitmap &other) {
+  if (other.words.size() > words.size())
+    words.resize(other.words.size());
+  for (size_t i = 0; i < other.words.size(); i++)
+    words[i] ^= other.words[i];
+  return *this;
+}
+
+// Serialized as the size in bits, the number of 64-bit words, the words and
+// the position of the last run-length word, all big-endian.  Each
+// run-length word holds the running bit in bit 0, the length of the run in
+// words in bits 1-32 and the number of literal words that follow it in bits
+// 33-63.
+std::optional<ewah_bitmap>
+ewah_bitmap::parse(std::span<const unsigned char> &data) {
+  if (data.size() < 12)
+    return {};
+
+  ewah_bitmap b;
+  b.bit_size = be32(data.data());
+  const size_t word_count = be32(data.data() + 4);
+  if ((data.size() - 12) / 8 < word_count)
+    return {};
+
+  b.words = data.subspan(8, word_count * 8);
+  data = data.subspan(8 + word_count * 8 + 4);
+  return b;
+}
+
+size_t ewah_bitmap::count() const {
+  size_t n = 0;
+  size_t pos = 0;
+  const size_t word_count = words.size() / 8;
+  while (pos < word_count) {
+    const uint64_t rlw = be64(words.data() + pos * 8);
+    pos++;
+    if (rlw & 1)
+      n += size_t((rlw >> 1) & 0xffffffffu) * 64;
+    const size_t literals = std::min(size_t(rlw >> 33), word_count - pos);
+    for (size_t i = 0; i < literals; i++)
+      n += size_t(std::popcount(be64(words.data() + (pos + i) * 8)));
+    pos += literals;
+  }
+  return n;
+}
+
+bitmap ewah_bitmap::decompress() const {
+  bitmap out;
+  const size_t total = (size_t(bit_size) + 63) / 64;
+  out.words.reserve(total);
+
+  size_t pos = 0;
+  const size_t word_count = words.size() / 8;
+  while (pos < word_count && out.words.size() < total) {
+    const uint64_t rlw = be64(words.data() + pos * 8);
+    pos++;
+    const size_t run = std::min(size_t((rlw >> 1) & 0xffffffffu),
+                                total - out.words.size());
+    out.words.insert(out.words.end(), run, rlw & 1 ? ~uint64_t(0) : 0);
+    const size_t literals = std::min(
+        {size_t(rlw >> 33), word_count - pos, total - out.words.size()});
+    for (size_t i = 0; i < literals; i++)
+      out.words.push_back(be64(words.data() + (pos + i) * 8));
+    pos += literals;
+  }
+  return out;
+}
+
+// Header of "BITM", version, options, number of stored bitmaps and the pack
+// checksum, then the commit, tree, blob and tag type bitmaps, then the
+// stored bitmaps each preceded by the index position of its commit, the
+// distance to the earlier entry it is XOR'ed against and flags.
+std::optional<pack_bitmap>
+pack_bitmap::open(const std::filesystem::path &idx_path) {
+  auto bitmap_path = idx_path;
+  bitmap_path.replace_extension(".bitmap");
+
+  auto file = mapped_file::open(bitmap_path);
+  if (!file)
+    return {};
+  auto index = pack_index::open(idx_path);
+  if (!index)
+    return {};
+
+  std::span<const unsigned char> data = file->bytes();
+  const size_t header = 12 + oid_size;
+  if (data.size() < header + oid_size || memcmp(data.data(), "BITM", 4) != 0)
+    return {};
+
+  const unsigned version = unsigned(data[4]) << 8 | data[5];
+  const uint32_t count = be32(data.data() + 8);
+  auto checksum = index->pack_checksum();
+  if (version != 1 ||
+      memcmp(data.data() + 12, checksum.data(), checksum.size()) != 0)
+    return {};
+
+  pack_bitmap pb(std::move(*index), std::move(*file));
+  pb.idx_path = idx_path;
+  data = data.subspan(header);
+
+  // No bitmap covers more than the pack's objects, git rounds the size up
+  // to whole words at most.  A size from a corrupt file would otherwise be
+  // allocated when decompressing.
+  const size_t objects = (size_t(pb.index.size()) + 63) / 64 * 64;
+  auto commits = ewah_bitmap::parse(data);
+  for (int i = 0; i < 3; i++)
+    if (auto type = ewah_bitmap::parse(data); !type || type->size() > objects)
+      return {};
+  if (!commits || commits->size() > objects)
+    return {};
+  pb.commits = *commits;
+
+  pb.entries.reserve(std::min<size_t>(count, data.size() / 18));
+  for (uint32_t i = 0; i < count; i++) {
+    if (data.size() < 6)
+      return {};
+    const uint32_t index_pos = be32(data.data());
+    const uint8_t xor_offset = data[4];
+    data = data.subspan(6);
+
+    auto bits = ewah_bitmap::parse(data);
+    if (!bits || bits->size() > objects || index_pos >= pb.index.size() ||
+        xor_offset > i)
+      return {};
+    pb.entry_of.emplace(index_pos, pb.entries.size());
+    pb.entries.push_back({index_pos, xor_offset, *bits});
+  }
+
+  pb.decoded.resize(pb.entries.size());
+  return pb;
+}
+
+std::optional<uint32_t> pack_bitmap::position(const git_oid &id) const {
+  auto index_pos = index.find(id);
+  if (!index_pos)
+    return {};
+
+  // Only built once a position is actually asked for.
+  if (positions.empty()) {
+    auto order = pack_order(index, idx_path);
+    positions.resize(order.size());
+    for (uint32_t pack_pos = 0; pack_pos < order.size(); pack_pos++)
+      positions[order[pack_pos]] = pack_pos;
+  }
+  return positions[*index_pos];
+}
+
+const bitmap &pack_bitmap::decode(size_t entry) const {
+  // XOR chains can be long, so find where the chain is already decoded (or
+  // ends) and decode forward from there instead of recursing.
+  std::vector<size_t> chain;
+  for (size_t e = entry; !decoded[e]; e -= entries[e].xor_offset) {
+    chain.push_back(e);
+    if (!entries[e].xor_offset)
+      break;
+  }
+
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    const size_t e = *it;
+    bitmap b = entries[e].bits.decompress();
+    if (entries[e].xor_offset)
+      b ^= *decoded[e - entries[e].xor_offset];
+    decoded[e] = std::move(b);
+  }
+
+  return *decoded[entry];
+}
+
+const bitmap *pack_bitmap::reachable_from(const git_oid &commit) const {
+  auto index_pos = index.find(commit);
+  if (!index_pos)
+    return nullptr;
+  auto it = entry_of.find(*index_pos);
+  if (it == entry_of.end())
+    return nullptr;
+  return &decode(it->second);
+}
+
+std::optional<bool> pack_bitmap::is_reachable(const git_oid &id,
+                                              const git_oid &from) const {
+  const bitmap *reach = reachable_from(from);
+  if (!reach)
+    return {};
+  auto pos = position(id);
+  return pos && reach->test(*pos);
+}
+
+std::optional<size_t> pack_bitmap::count_commits(const git_oid &from) const {
+  const bitmap *reach = reachable_from(from);
+  if (!reach)
+    return {};
+  if (!commit_mask)
+    commit_mask = commits.decompress();
+  return reach->count_and(*commit_mask);
+}
+
+std::optional<pack_bitmap>
+find_pack_bitmap(const std::filesystem::path &objects_dir) {
+  std::error_code ec;
+  for (const auto &f : std::filesystem::directory_iterator(
+           objects_dir / "pack", ec)) {
+    if (f.path().extension() != ".bitmap")
+      continue;
+    auto idx = f.path();
+    idx.replace_extension(".idx");
+    if (auto pb = pack_bitmap::open(idx))
+      return pb;
+  }
+  return {};
+}
+
+object_prefetcher
+object_prefetcher::open(const std::filesystem::path &objects_dir) {
+  object_prefetcher prefetcher(objects_dir);
+  std::error_code ec;
+  for (const auto &f : std::filesystem::directory_iterator(
+           objects_dir / "pack", ec)) {
+    if (f.path().extension() != ".idx")
+      continue;
+    auto index = pack_index::open(f.path());
+    if (!index)
+      continue;
+    auto pack_path = f.path();
+    pack_path.replace_extension(".pack");
+    int fd = ::open(pack_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    prefetcher.packs.push_back({std::move(*index), fd});
+  }
+  return prefetcher;
+}
+
+object_prefetcher::~object_prefetcher() {
+  for (const auto &p : packs)
+    close(p.fd);
+}
+
+void object_prefetcher::prefetch(std::span<const git_oid> ids) const {
+  // The size of an object isn't in the index, assume commits and trees
+  // fit in the window.  Reading a gap is cheaper than another round trip.
+  constexpr uint64_t window = 8 * 1024;
+  constexpr uint64_t max_gap = 64 * 1024;
+  constexpr size_t max_openers = 8;
+
+  struct range {
+    size_t pack;
+    uint64_t begin;
+    uint64_t end;
+  };
+  std::vector<range> ranges;
+  std::vector<std::filesystem::path> loose;
+
+  for (const auto &id : ids) {
+    bool packed = false;
+    for (size_t i = 0; i < packs.size() && !packed; i++) {
+      if (auto pos = packs[i].index.find(id)) {
+        const uint64_t offset = packs[i].index.offset(*pos);
+        ranges.push_back({i, offset, offset + window});
+        packed = true;
+      }
+    }
+    if (packed)
+      continue;
+
+    char hex[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(hex, sizeof(hex), &id);
+    loose.push_back(objects_dir / std::string_view(hex, 2) / (hex + 2));
+  }
+
+  // Every loose object is an open, a round trip each on a network
+  // filesystem, so they are issued from a few threads to overlap.  Sorted
+  // so each thread's lookups go through the same fan-out directories.
+  std::ranges::sort(loose);
+  const size_t openers = std::min(loose.size(), max_openers);
+  const size_t per_opener =
+      openers ? (loose.size() + openers - 1) / openers : 0;
+  std::vector<std::jthread> threads;
+  for (size_t t = 0; t < openers; t++)
+    threads.emplace_back([&, t] {
+      const size_t end = std::min(loose.size(), (t + 1) * per_opener);
+      for (size_t i = t * per_opener; i < end; i++) {
+        int fd = ::open(loose[i].c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+          continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+      }
+    });
+
+  std::ranges::sort(ranges, {}, [](const range &r) {
+    return std::pair(r.pack, r.begin);
+  });
+  for (size_t i = 0; i < ranges.size();) {
+    range merged = ranges[i++];
+    while (i < ranges.size() && ranges[i].pack == merged.pack &&
+           ranges[i].begin <= merged.end + max_gap)
+      merged.end = std::max(merged.end, ranges[i++].end);
+    posix_fadvise(packs[merged.pack].fd, off_t(merged.begin),
+                  off_t(merged.end - merged.begin), POSIX_FADV_WILLNEED);
+  }
+}
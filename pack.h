@@ -0,0 +1,208 @@
+// Copyright (c) 2022 Caio Oliveira
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Readers for the pack files git keeps in objects/pack: the version 2 pack
+// index (.idx), the reverse index (.rev) and the EWAH-compressed
+// reachability bitmaps (.bitmap).  Only what git-recent needs is decoded,
+// everything is read from read-only mappings of the files.
+
+#pragma once
+
+#include <git2.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+// Read-only mapping of a whole file.
+class mapped_file {
+public:
+  static std::optional<mapped_file> open(const std::filesystem::path &path);
+
+  mapped_file(mapped_file &&other) noexcept;
+  mapped_file &operator=(mapped_file &&other) noexcept;
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+  ~mapped_file();
+
+  std::span<const unsigned char> bytes() const {
+    return {static_cast<const unsigned char *>(data), size};
+  }
+
+private:
+  mapped_file(void *data, size_t size) : data(data), size(size) {}
+
+  void *data = nullptr;
+  size_t size = 0;
+};
+
+// Version 2 pack index: the object ids of a pack in sorted order, with the
+// offsets of the objects in the pack.  Index positions refer to that order.
+class pack_index {
+public:
+  static std::optional<pack_index> open(const std::filesystem::path &path);
+
+  uint32_t size() const { return count; }
+
+  std::optional<uint32_t> find(const git_oid &id) const;
+  git_oid id(uint32_t pos) const;
+  uint64_t offset(uint32_t pos) const;
+
+  // Checksum of the .pack file this index describes.
+  std::span<const unsigned char, 20> pack_checksum() const;
+
+private:
+  explicit pack_index(mapped_file file) : file(std::move(file)) {}
+
+  mapped_file file;
+  uint32_t count = 0;
+  const unsigned char *fanout = nullptr;
+  const unsigned char *ids = nullptr;
+  const unsigned char *offsets = nullptr;
+  const unsigned char *large_offsets = nullptr;
+  size_t large_offset_count = 0;
+};
+
+// Index positions in the order the objects appear in the pack, read from
+// the .rev file next to the index when there is one, or computed by
+// sorting the offsets otherwise.
+std::vector<uint32_t> pack_order(const pack_index &index,
+                                 const std::filesystem::path &idx_path);
+
+// Uncompressed bitmap, bit N is bit N % 64 of word N / 64.
+class bitmap {
+public:
+  bool test(size_t pos) const {
+    return pos / 64 < words.size() && (words[pos / 64] >> (pos % 64)) & 1;
+  }
+
+  void set(size_t pos);
+
+  size_t count() const;
+  size_t count_and(const bitmap &other) const;
+
+  bitmap &operator|=(const bitmap &other);
+  bitmap &operator^=(const bitmap &other);
+
+  std::vector<uint64_t> words;
+};
+
+// EWAH-compressed bitmap in git's serialization, referencing the bytes of
+// the mapped file so it is only decoded when needed.
+class ewah_bitmap {
+public:
+  // Parses the bitmap at the front of data and advances data past it.
+  static std::optional<ewah_bitmap>
+  parse(std::span<const unsigned char> &data);
+
+  // Number of bits, as stored.  Decompressing allocates this many.
+  size_t size() const { return bit_size; }
+
+  // Number of set bits, counted on the compressed form.
+  size_t count() const;
+
+  bitmap decompress() const;
+
+private:
+  uint32_t bit_size = 0;
+  std::span<const unsigned char> words;
+};
+
+// Reachability bitmaps of a pack, git's .bitmap format version 1.  Bit N of
+// every bitmap is the Nth object in pack order.  Only some commits have a
+// stored bitmap; for the others callers need to walk until they hit one.
+class pack_bitmap {
+public:
+  // Opens the .bitmap for the given .idx, if present and consistent.
+  static std::optional<pack_bitmap> open(const std::filesystem::path &idx_path);
+
+  // Bit position of an object, if it is in the pack.
+  std::optional<uint32_t> position(const git_oid &id) const;
+
+  // Objects reachable from the commit, if it has a stored bitmap.  Decoded
+  // bitmaps, including the ones they are XOR'ed against, are kept.
+  const bitmap *reachable_from(const git_oid &commit) const;
+
+  // Whether a commit is reachable from another that has a stored bitmap.
+  std::optional<bool> is_reachable(const git_oid &id,
+                                   const git_oid &from) const;
+
+  // Number of commits reachable from a commit that has a stored bitmap.
+  std::optional<size_t> count_commits(const git_oid &from) const;
+
+private:
+  pack_bitmap(pack_index index, mapped_file file)
+      : index(std::move(index)), file(std::move(file)) {}
+
+  const bitmap &decode(size_t entry) const;
+
+  struct stored {
+    uint32_t index_pos;
+    uint8_t xor_offset;
+    ewah_bitmap bits;
+  };
+
+  pack_index index;
+  mapped_file file;
+  std::filesystem::path idx_path;
+  ewah_bitmap commits;
+  std::vector<stored> entries;
+  std::unordered_map<uint32_t, size_t> entry_of;
+
+  mutable std::vector<uint32_t> positions;
+  mutable std::vector<std::optional<bitmap>> decoded;
+  mutable std::optional<bitmap> commit_mask;
+};
+
+// Bitmap of the first pack in objects/pack that has one.
+std::optional<pack_bitmap>
+find_pack_bitmap(const std::filesystem::path &objects_dir);
+
+// Read-ahead hints for objects that are about to be read, for repositories
+// on network filesystems where every read is a round trip.  Objects are
+// located through the pack indexes and hints for objects close to each
+// other in a pack are merged, so the reads become few and sequential.
+class object_prefetcher {
+public:
+  static object_prefetcher open(const std::filesystem::path &objects_dir);
+
+  object_prefetcher(object_prefetcher &&) = default;
+  object_prefetcher &operator=(object_prefetcher &&) = delete;
+  ~object_prefetcher();
+
+  void prefetch(std::span<const git_oid> ids) const;
+
+private:
+  struct pack {
+    pack_index index;
+    int fd;
+  };
+
+  explicit object_prefetcher(std::filesystem::path objects_dir)
+      : objects_dir(std::move(objects_dir)) {}
+
+  std::filesystem::path objects_dir;
+  std::vector<pack> packs;
+};
@@ -0,0 +1,33 @@
+# Runs git-recent in a freshly created fixture repository and compares its
+# output with the expected file.  The fixture is created right before so
+# ages computed from the current time can't drift.
+#
+# Expects GIT, GIT_RECENT, FIXTURE (the script creating the repository),
+# DIR, ARGS and EXPECTED, and optionally NOW for FIXTURE.
+
+cmake_minimum_required(VERSION 3.22)
+
+if(DEFINED NOW)
+  set(now_arg -DNOW=${NOW})
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} -DGIT=${GIT} -DDIR=${DIR} ${now_arg}
+                        -P ${FIXTURE}
+                COMMAND_ERROR_IS_FATAL ANY)
+
+# Absolute dates are shown in local time.
+set(ENV{TZ} UTC)
+separate_arguments(args UNIX_COMMAND "${ARGS}")
+execute_process(COMMAND ${GIT_RECENT} ${args}
+                WORKING_DIRECTORY ${DIR}
+                OUTPUT_VARIABLE output
+                ERROR_VARIABLE error
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "git-recent ${ARGS} failed (${result}):\n${error}")
+endif()
+
+file(READ ${EXPECTED} expected)
+if(NOT output STREQUAL expected)
+  message(FATAL_ERROR "git-recent ${ARGS} printed:\n${output}"
+                      "instead of:\n${expected}")
+endif()
@@ -0,0 +1,372 @@
+// Copyright (c) 2022 Caio Oliveira
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Differential test of the native readers against libgit2 on randomly
+// generated repositories: commit summaries read from raw objects against
+// git_commit_summary(), the pack index and reverse index against the
+// objects that were written, pack bitmaps against revision walks, and the
+// output of git-recent --stale, which finds merged branches through the
+// bitmaps once the repository is packed and through a revision walk before.
+//
+// Usage: differential GIT GIT_RECENT [ITERATIONS [SEED]]
+//
+// Iteration I uses seed SEED + I, and SEED is printed first so that runs
+// that fail, even by crashing, can be repeated.  Without a SEED a random
+// one is picked.
+
+#include "commit.h"
+#include "pack.h"
+
+#include <git2.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+using namespace std::string_view_literals;
+
+template <typename T> using git_ptr = std::unique_ptr<T, void (*)(T *)>;
+
+int failures = 0;
+
+void check(bool ok, uint32_t seed, const std::string &what) {
+  if (ok)
+    return;
+  std::cerr << "seed " << seed << ": " << what << "\n";
+  failures++;
+}
+
+void die_on_git_error(int err, const char *what) {
+  if (err >= 0)
+    return;
+  const git_error *e = git_error_last();
+  std::cerr << what << ": " << (e ? e->message : "unknown error") << "\n";
+  std::exit(2);
+}
+
+std::string hex(const git_oid &id) {
+  char buf[GIT_OID_HEXSZ + 1];
+  return git_oid_tostr(buf, sizeof(buf), &id);
+}
+
+std::string quote(const std::string &s) {
+  std::string out = "'";
+  for (char c : s)
+    out += c == '\'' ? std::string("'\\''") : std::string(1, c);
+  return out + "'";
+}
+
+std::string capture(const std::string &command) {
+  std::string out;
+  FILE *p = popen(command.c_str(), "r");
+  if (!p)
+    return out;
+  char buf[4096];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), p)) > 0;)
+    out.append(buf, n);
+  if (pclose(p) != 0)
+    out += "\n(exited with an error)";
+  return out;
+}
+
+// Messages built from the pieces that matter to the summary: whitespace of
+// every kind, line breaks and paragraph breaks, multibyte text and the
+// occasional NUL that libgit2 stops at.
+std::string random_message(std::mt19937 &rng) {
+  static constexpr std::string_view pieces[] = {
+      "fix", "the bug", "\xc3\xa4\xc3\xb6\xc3\xbc", " ",    "  ",
+      "\t",  "\n",      "\n\n",                     "\r\n", " \n",
+      "\v",  "\f",      "\n \t\n",                  "x",    "\0"sv};
+  std::string message;
+  const int count = std::uniform_int_distribution(0, 12)(rng);
+  for (int i = 0; i < count; i++) {
+    auto piece = pieces[std::uniform_int_distribution<size_t>(
+        0, std::size(pieces) - 1)(rng)];
+    // Keep NULs rare, git itself refuses to write them.
+    if (piece == "\0"sv && std::uniform_int_distribution(0, 3)(rng))
+      continue;
+    message += piece;
+  }
+  return message;
+}
+
+struct generated {
+  std::vector<git_oid> commits;
+  // Objects reachable from the branches, the ones git repack packs.
+  std::vector<git_oid> packed_commits;
+  std::vector<git_oid> packed_objects;
+};
+
+generated generate(git_repository *repo, std::mt19937 &rng) {
+  git_odb *odb_ = nullptr;
+  die_on_git_error(git_repository_odb(&odb_, repo), "git_repository_odb");
+  git_ptr<git_odb> odb(odb_, git_odb_free);
+
+  generated g;
+  git_oid tree;
+  die_on_git_error(git_odb_write(&tree, odb.get(), "", 0, GIT_OBJECT_TREE),
+                   "git_odb_write");
+
+  const int count = std::uniform_int_distribution(1, 150)(rng);
+  for (int i = 0; i < count; i++) {
+    std::string raw = "tree " + hex(tree) + "\n";
+    if (i > 0 && std::uniform_int_distribution(0, 19)(rng)) {
+      // Mostly recent parents, so the history has long chains.
+      const int back = std::min(i, 1 + std::geometric_distribution(0.3)(rng));
+      raw += "parent " + hex(g.commits[i - back]) + "\n";
+      if (i > 1 && !std::uniform_int_distribution(0, 4)(rng))
+        raw += "parent " +
+               hex(g.commits[std::uniform_int_distribution(0, i - 1)(rng)]) +
+               "\n";
+    }
+    const std::string when = std::to_string(1577836800 + i * 600) + " +0000";
+    raw += "author A U Thor <author@example.com> " + when + "\n";
+    raw += "committer A U Thor <author@example.com> " + when + "\n";
+    const std::string message = random_message(rng);
+    if (!message.empty() || std::uniform_int_distribution(0, 1)(rng))
+      raw += "\n" + message;
+
+    git_oid id;
+    die_on_git_error(git_odb_write(&id, odb.get(), raw.data(), raw.size(),
+                                   GIT_OBJECT_COMMIT),
+                     "git_odb_write");
+    g.commits.push_back(id);
+  }
+
+  git_revwalk *walk_ = nullptr;
+  die_on_git_error(git_revwalk_new(&walk_, repo), "git_revwalk_new");
+  git_ptr<git_revwalk> walk(walk_, git_revwalk_free);
+
+  const int branches = std::uniform_int_distribution(1, 20)(rng);
+  for (int i = 0; i <= branches; i++) {
+    const std::string name =
+        i == 0 ? "refs/heads/master" : "refs/heads/b" + std::to_string(i);
+    const git_oid &target =
+        i == 0 ? g.commits.back()
+               : g.commits[std::uniform_int_distribution<size_t>(
+                     0, g.commits.size() - 1)(rng)];
+    git_reference *ref = nullptr;
+    die_on_git_error(git_reference_create(&ref, repo, name.c_str(), &target,
+                                          1, nullptr),
+                     "git_reference_create");
+    git_reference_free(ref);
+    die_on_git_error(git_revwalk_push(walk.get(), &target),
+                     "git_revwalk_push");
+  }
+  die_on_git_error(git_repository_set_head(repo, "refs/heads/master"),
+                   "git_repository_set_head");
+
+  for (git_oid id; git_revwalk_next(&id, walk.get()) == 0;)
+    g.packed_commits.push_back(id);
+  g.packed_objects = g.packed_commits;
+  g.packed_objects.push_back(tree);
+  return g;
+}
+
+void check_summaries(git_repository *repo, const generated &g,
+                     uint32_t seed) {
+  git_odb *odb_ = nullptr;
+  die_on_git_error(git_repository_odb(&odb_, repo), "git_repository_odb");
+  git_ptr<git_odb> odb(odb_, git_odb_free);
+
+  for (const auto &id : g.commits) {
+    git_odb_object *obj_ = nullptr;
+    die_on_git_error(git_odb_read(&obj_, odb.get(), &id), "git_odb_read");
+    git_ptr<git_odb_object> obj(obj_, git_odb_object_free);
+    const std::string_view raw(
+        static_cast<const char *>(git_odb_object_data(obj.get())),
+        git_odb_object_size(obj.get()));
+    std::string native;
+    append_summary(native, raw_commit_message(raw));
+
+    git_commit *commit_ = nullptr;
+    die_on_git_error(git_commit_lookup(&commit_, repo, &id),
+                     "git_commit_lookup");
+    git_ptr<git_commit> commit(commit_, git_commit_free);
+    const char *summary = git_commit_summary(commit.get());
+
+    check(native == (summary ? summary : ""), seed,
+          "summary of " + hex(id) + " is \"" + native + "\", libgit2 has \"" +
+              (summary ? summary : "") + "\"");
+  }
+}
+
+void check_pack_index(const std::filesystem::path &idx_path,
+                      const generated &g, uint32_t seed) {
+  auto index = pack_index::open(idx_path);
+  check(index.has_value(), seed, "can't open " + idx_path.string());
+  if (!index)
+    return;
+
+  check(index->size() == g.packed_objects.size(), seed,
+        "index has " + std::to_string(index->size()) + " objects, " +
+            std::to_string(g.packed_objects.size()) + " were packed");
+  for (const auto &id : g.packed_objects) {
+    auto pos = index->find(id);
+    const git_oid found = pos ? index->id(*pos) : git_oid{};
+    check(pos && git_oid_equal(&id, &found), seed,
+          "index doesn't find " + hex(id));
+    git_oid absent = id;
+    absent.id[19] ^= 0x5a;
+    if (std::ranges::none_of(g.packed_objects, [&](const git_oid &o) {
+          return git_oid_equal(&o, &absent);
+        }))
+      check(!index->find(absent), seed, "index finds absent " + hex(absent));
+  }
+
+  // With and without the reverse index, pack order is by offset.
+  auto rev_path = idx_path;
+  rev_path.replace_extension(".rev");
+  const bool has_rev = std::filesystem::exists(rev_path);
+  const auto order = pack_order(*index, idx_path);
+  for (size_t i = 1; i < order.size(); i++)
+    check(index->offset(order[i - 1]) < index->offset(order[i]), seed,
+          "pack order isn't by offset at " + std::to_string(i));
+  if (has_rev) {
+    const auto renamed = rev_path.string() + ".off";
+    std::filesystem::rename(rev_path, renamed);
+    check(pack_order(*index, idx_path) == order, seed,
+          "pack order differs without the reverse index");
+    std::filesystem::rename(renamed, rev_path);
+  }
+}
+
+size_t walk_count(git_repository *repo, const git_oid &from) {
+  git_revwalk *walk_ = nullptr;
+  die_on_git_error(git_revwalk_new(&walk_, repo), "git_revwalk_new");
+  git_ptr<git_revwalk> walk(walk_, git_revwalk_free);
+  die_on_git_error(git_revwalk_push(walk.get(), &from), "git_revwalk_push");
+  size_t n = 0;
+  for (git_oid id; git_revwalk_next(&id, walk.get()) == 0;)
+    n++;
+  return n;
+}
+
+void check_bitmaps(git_repository *repo, const std::filesystem::path &idx_path,
+                   const generated &g, uint32_t seed) {
+  auto bitmaps = pack_bitmap::open(idx_path);
+  check(bitmaps.has_value(), seed,
+        "can't open the bitmap of " + idx_path.string());
+  if (!bitmaps)
+    return;
+
+  for (const auto &from : g.packed_commits) {
+    auto count = bitmaps->count_commits(from);
+    if (!count)
+      continue;
+    check(*count == walk_count(repo, from), seed,
+          "bitmap of " + hex(from) + " has " + std::to_string(*count) +
+              " commits, the walk " +
+              std::to_string(walk_count(repo, from)));
+    for (const auto &id : g.packed_commits) {
+      const bool expected = git_oid_equal(&id, &from) ||
+                            git_graph_descendant_of(repo, &from, &id) == 1;
+      check(bitmaps->is_reachable(id, from) == expected, seed,
+            hex(id) + (expected ? " is" : " isn't") + " reachable from " +
+                hex(from) + ", the bitmap disagrees");
+    }
+  }
+}
+
+void run_once(const std::string &git, const std::string &git_recent,
+              uint32_t seed) {
+  std::mt19937 rng(seed);
+  const auto dir = std::filesystem::temp_directory_path() /
+                   ("git-recent-differential-" + std::to_string(getpid()));
+  std::filesystem::remove_all(dir);
+
+  git_repository *repo_ = nullptr;
+  die_on_git_error(git_repository_init(&repo_, dir.c_str(), 0),
+                   "git_repository_init");
+  git_ptr<git_repository> repo(repo_, git_repository_free);
+
+  const auto g = generate(repo.get(), rng);
+  check_summaries(repo.get(), g, seed);
+
+  const std::string list = "cd " + quote(dir) + " && " + quote(git_recent) +
+                           " --stale 0 --base master --absolute --color never";
+  const std::string loose = capture(list);
+
+  const int err = std::system((quote(git) + " -C " + quote(dir) +
+                               " -c pack.writeReverseIndex=true"
+                               " repack -adbq")
+                                  .c_str());
+  check(err == 0, seed, "git repack failed");
+  if (err == 0) {
+    // The pack's objects are only seen by a repository opened afterwards.
+    repo.reset();
+    die_on_git_error(git_repository_open(&repo_, dir.c_str()),
+                     "git_repository_open");
+    repo.reset(repo_);
+
+    std::filesystem::path idx_path;
+    for (const auto &f : std::filesystem::directory_iterator(
+             dir / ".git" / "objects" / "pack"))
+      if (f.path().extension() == ".idx")
+        idx_path = f.path();
+    check_pack_index(idx_path, g, seed);
+    check_bitmaps(repo.get(), idx_path, g, seed);
+    check_summaries(repo.get(), g, seed);
+
+    const std::string packed = capture(list);
+    check(packed == loose, seed,
+          "git-recent output changed after packing:\n" + loose + "---\n" +
+              packed);
+  }
+
+  repo.reset();
+  std::filesystem::remove_all(dir);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc > 5) {
+    std::cerr << "usage: " << argv[0]
+              << " GIT GIT_RECENT [ITERATIONS [SEED]]\n";
+    return 2;
+  }
+  const int iterations = argc > 3 ? std::atoi(argv[3]) : 20;
+  const uint32_t seed =
+      argc > 4 ? uint32_t(std::strtoul(argv[4], nullptr, 10))
+               : std::random_device()();
+
+  std::cerr << "seed " << seed << ", " << iterations << " iterations\n";
+  git_libgit2_init();
+  for (int i = 0; i < iterations; i++)
+    run_once(argv[1], argv[2], seed + uint32_t(i));
+  git_libgit2_shutdown();
+
+  if (failures)
+    std::cerr << failures << " failures, rerun with seed " << seed << "\n";
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,54 @@
+# Creates the repository for the performance tests: a history of 1000
+# commits and 100000 branches spread over them, written as packed-refs the
+# way a large repository keeps most of its refs.  user.email matches none
+# of the commits, so --mine walks all of the history.
+#
+# Expects GIT and DIR.  An existing fixture is kept.
+
+cmake_minimum_required(VERSION 3.22)
+
+if(EXISTS ${DIR}/packed-refs)
+  return()
+endif()
+
+file(REMOVE_RECURSE ${DIR})
+execute_process(COMMAND ${GIT} init -q --bare -b master ${DIR}
+                COMMAND_ERROR_IS_FATAL ANY)
+execute_process(COMMAND ${GIT} -C ${DIR} config user.email nobody@example.com
+                COMMAND_ERROR_IS_FATAL ANY)
+
+set(stream "")
+foreach(mark RANGE 1 1000)
+  math(EXPR time "1600000000 + ${mark} * 3600")
+  string(APPEND stream
+         "commit refs/heads/master\n"
+         "mark :${mark}\n"
+         "committer A U Thor <author@example.com> ${time} +0000\n"
+         "data <<EOM\nCommit ${mark}\nEOM\n\n")
+endforeach()
+
+file(WRITE ${DIR}/fixture.stream "${stream}")
+execute_process(COMMAND ${GIT} -C ${DIR} fast-import --quiet
+                        --export-marks=${DIR}/fixture.marks
+                INPUT_FILE ${DIR}/fixture.stream
+                COMMAND_ERROR_IS_FATAL ANY)
+
+# 100 branches per commit, named so that they are written in sorted order.
+# Written a commit at a time, appending to one large string is quadratic.
+file(STRINGS ${DIR}/fixture.marks marks)
+file(WRITE ${DIR}/packed-refs.tmp
+     "# pack-refs with: peeled fully-peeled sorted \n")
+foreach(line IN LISTS marks)
+  string(REGEX REPLACE "^:([0-9]+) ([0-9a-f]+)$" "\\1;\\2" fields "${line}")
+  list(GET fields 0 mark)
+  list(GET fields 1 id)
+  math(EXPR prefix "1000 + ${mark}")
+  set(refs "")
+  foreach(n RANGE 100 199)
+    string(APPEND refs "${id} refs/heads/b${prefix}${n}\n")
+  endforeach()
+  file(APPEND ${DIR}/packed-refs.tmp "${refs}")
+endforeach()
+
+file(REMOVE ${DIR}/fixture.stream ${DIR}/fixture.marks)
+file(RENAME ${DIR}/packed-refs.tmp ${DIR}/packed-refs)
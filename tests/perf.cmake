@@ -0,0 +1,34 @@
+# Runs git-recent in the many refs fixture a few times and fails when even
+# the fastest run took longer than the budget.  The plain invocation is
+# timed, --profile would time the instrumented allocator and object
+# database instead of the default path.
+#
+# Expects GIT_RECENT, REPO, ARGS, BUDGET_MS and RUNS.
+
+# Microsecond timestamps need 3.23.
+cmake_minimum_required(VERSION 3.23)
+
+separate_arguments(args UNIX_COMMAND "${ARGS}")
+set(best "")
+foreach(run RANGE 1 ${RUNS})
+  string(TIMESTAMP start "%s%f" UTC)
+  execute_process(COMMAND ${GIT_RECENT} ${args}
+                  WORKING_DIRECTORY ${REPO}
+                  OUTPUT_QUIET
+                  ERROR_VARIABLE error
+                  RESULT_VARIABLE result)
+  string(TIMESTAMP end "%s%f" UTC)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "git-recent ${ARGS} failed (${result}):\n${error}")
+  endif()
+  math(EXPR elapsed "(${end} - ${start}) / 1000")
+  if(best STREQUAL "" OR elapsed LESS best)
+    set(best ${elapsed})
+  endif()
+endforeach()
+
+message(STATUS "git-recent ${ARGS}: ${best} ms, budget ${BUDGET_MS} ms")
+if(best GREATER BUDGET_MS)
+  message(FATAL_ERROR "git-recent ${ARGS} took ${best} ms, "
+                      "over the budget of ${BUDGET_MS} ms")
+endif()
@@ -0,0 +1,60 @@
+# Creates the repository the output tests run in: a few local branches
+# with ages from minutes to years, master checked out, and remote branches
+# including a symbolic origin/HEAD.
+#
+# Expects GIT and DIR, and NOW as seconds since the epoch for dates that
+# don't depend on when the tests run (the current time otherwise).
+
+cmake_minimum_required(VERSION 3.22)
+
+if(NOT DEFINED NOW)
+  string(TIMESTAMP NOW "%s" UTC)
+endif()
+
+file(REMOVE_RECURSE ${DIR})
+execute_process(COMMAND ${GIT} init -q -b master ${DIR}
+                COMMAND_ERROR_IS_FATAL ANY)
+
+# Ref, age in seconds, parent mark and message of each commit, marked in
+# order from 1.
+set(commits
+    "refs/heads/ancient|69120000||Initial import"
+    "refs/heads/topic|1296000|1|Sketch the topic"
+    "refs/heads/feature|262800|1|Add the feature"
+    "refs/heads/master|7800|3|Merge the feature"
+    "refs/heads/wip|330|4|Work in progress"
+    "refs/remotes/origin/fix|518400|1|Fix the build")
+
+set(stream "")
+set(mark 0)
+foreach(commit IN LISTS commits)
+  string(REPLACE "|" ";" fields "${commit}")
+  list(GET fields 0 ref)
+  list(GET fields 1 age)
+  list(GET fields 2 parent)
+  list(GET fields 3 message)
+  math(EXPR mark "${mark} + 1")
+  math(EXPR time "${NOW} - ${age}")
+  string(APPEND stream
+         "commit ${ref}\n"
+         "mark :${mark}\n"
+         "committer A U Thor <author@example.com> ${time} +0000\n"
+         "data <<EOM\n${message}\nEOM\n")
+  if(parent)
+    string(APPEND stream "from :${parent}\n")
+  endif()
+  string(APPEND stream "\n")
+endforeach()
+string(APPEND stream "reset refs/remotes/origin/master\nfrom :4\n\n")
+
+file(WRITE ${DIR}/fixture.stream "${stream}")
+execute_process(COMMAND ${GIT} -C ${DIR} fast-import --quiet
+                INPUT_FILE ${DIR}/fixture.stream
+                COMMAND_ERROR_IS_FATAL ANY)
+file(REMOVE ${DIR}/fixture.stream)
+
+execute_process(COMMAND ${GIT} -C ${DIR} remote add origin ${DIR}
+                COMMAND_ERROR_IS_FATAL ANY)
+execute_process(COMMAND ${GIT} -C ${DIR} symbolic-ref
+                        refs/remotes/origin/HEAD refs/remotes/origin/master
+                COMMAND_ERROR_IS_FATAL ANY)